@@ -1,6 +1,11 @@
 
 #include <opencv2/opencv.hpp>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "face_3dmm.h"
+#include "face_fitting.h"
+#include "tools/flight_recorder.h"
 #include "face_base/face_detection.h"
 #include "face_base/face_align.h"
 
@@ -12,7 +17,7 @@
 #define StdMin(a,b)  (((a) < (b)) ? (a) : (b))
 #endif
 
-const float Landmark3D[] = {
+constexpr float Landmark3D[15] = {
 	-0.311487f,
 	+0.290361f,
 	+0.133780f,
@@ -31,9 +36,90 @@ const float Landmark3D[] = {
 };
 
 
+// Affine fit of the 5 points: A is (2N, 8) with rows [X 1 0 0 0 0] and [0 0 0 0 X 1],
+// so A^T A = diag(G, G) where G = sum([X 1]^T [X 1]) only depends on the 3d points.
+// The inverse of G is computed at compile time, a fit costs two 4x4 products.
+template <int NumPoints>
+class AffineFitSolver
+{
+public:
+	double inv_gram[4][4];
+
+public:
+	constexpr explicit AffineFitSolver(const float (&x)[NumPoints * 3]) : inv_gram()
+	{
+		// [G | I], Gauss-Jordan elimination with partial pivoting
+		double a[4][8] = {};
+		for (int n = 0; n < NumPoints; n++)
+		{
+			const double p[4] = { x[n * 3 + 0], x[n * 3 + 1], x[n * 3 + 2], 1. };
+			for (int i = 0; i < 4; i++)
+				for (int j = 0; j < 4; j++)
+					a[i][j] += p[i] * p[j];
+		}
+		for (int i = 0; i < 4; i++)
+			a[i][4 + i] = 1.;
+		for (int c = 0; c < 4; c++)
+		{
+			int pivot = c;
+			for (int r = c + 1; r < 4; r++)
+				if (absolute(a[r][c]) > absolute(a[pivot][c]))
+					pivot = r;
+			for (int j = 0; j < 8; j++)
+			{
+				const double tmp = a[c][j];
+				a[c][j] = a[pivot][j];
+				a[pivot][j] = tmp;
+			}
+			const double diag = a[c][c];
+			for (int j = 0; j < 8; j++)
+				a[c][j] /= diag;
+			for (int r = 0; r < 4; r++)
+			{
+				if (r == c) continue;
+				const double factor = a[r][c];
+				for (int j = 0; j < 8; j++)
+					a[r][j] -= factor * a[c][j];
+			}
+		}
+		for (int i = 0; i < 4; i++)
+			for (int j = 0; j < 4; j++)
+				inv_gram[i][j] = a[i][4 + j];
+	}
+
+	// xp: (N, 2) image points, x: (N, 3) the same points given to the constructor, k: 8 affine parameters
+	void solve(const float* xp, const float (&x)[NumPoints * 3], float* k) const
+	{
+		// A^T b, split into the two 4-dimensional blocks
+		double rhs[2][4] = {};
+		for (int n = 0; n < NumPoints; n++)
+		{
+			const double p[4] = { x[n * 3 + 0], x[n * 3 + 1], x[n * 3 + 2], 1. };
+			for (int i = 0; i < 4; i++)
+			{
+				rhs[0][i] += p[i] * xp[n * 2 + 0];
+				rhs[1][i] += p[i] * xp[n * 2 + 1];
+			}
+		}
+		for (int b = 0; b < 2; b++)
+			for (int i = 0; i < 4; i++)
+			{
+				double sum = 0.;
+				for (int j = 0; j < 4; j++)
+					sum += inv_gram[i][j] * rhs[b][j];
+				k[b * 4 + i] = static_cast<float>(sum);
+			}
+	}
+
+protected:
+	static constexpr double absolute(double v) { return v < 0. ? -v : v; }
+};
+
+
 Face3DMM::Face3DMM()
 {
 	face_tracker.setMode(FaceTracking::FaceTrackingMode::FastOneFace);
+	setNumWorkers(num_workers);
 }
 
 Face3DMM::~Face3DMM()
@@ -60,55 +146,67 @@ void Face3DMM::initialize(const char* path_param, const char* path_bin)
 	assert(net.load_param(path_param) == 0 && net.load_model(path_bin) == 0);
 }
 
-void Face3DMM::calculate5Points(const int* landmark, cv::Mat& mat, int height)
+void Face3DMM::setNumWorkers(int num_workers)
+{
+	assert(num_workers > 0);
+	this->num_workers = num_workers;
+	workers.clear();
+	for (int n = 0; n < num_workers; n++)
+		workers.emplace_back(new ForwardWorker());
+}
+
+void Face3DMM::setTemporalConfig(int regress_interval, float regress_motion, int lock_samples, float momentum)
+{
+	assert(regress_interval > 0 && lock_samples > 0);
+	this->regress_interval = regress_interval;
+	this->regress_motion = regress_motion;
+	this->lock_samples = lock_samples;
+	this->temporal_momentum = momentum;
+}
+
+void Face3DMM::setTrackingMode(FaceTracking::FaceTrackingMode mode)
+{
+	face_tracker.setMode(mode);
+}
+
+void Face3DMM::setFitting(const FaceFitting* face_fitting)
+{
+	this->face_fitting = face_fitting;
+}
+
+void Face3DMM::setRecorder(FlightRecorder* flight_recorder)
+{
+	this->flight_recorder = flight_recorder;
+}
+
+void Face3DMM::calculate5Points(const int* landmark, float* points, int height)
 {
-	int points[10];
 	// left-eye
-	points[0] = (landmark[2 * 36 + 0] + landmark[2 * 39 + 0]) / 2;
-	points[1] = (landmark[2 * 36 + 1] + landmark[2 * 39 + 1]) / 2;
+	points[0] = static_cast<float>((landmark[2 * 36 + 0] + landmark[2 * 39 + 0]) / 2);
+	points[1] = static_cast<float>((landmark[2 * 36 + 1] + landmark[2 * 39 + 1]) / 2);
 	// right-eye
-	points[2] = (landmark[2 * 42 + 0] + landmark[2 * 45 + 0]) / 2;
-	points[3] = (landmark[2 * 42 + 1] + landmark[2 * 45 + 1]) / 2;
+	points[2] = static_cast<float>((landmark[2 * 42 + 0] + landmark[2 * 45 + 0]) / 2);
+	points[3] = static_cast<float>((landmark[2 * 42 + 1] + landmark[2 * 45 + 1]) / 2);
 	// nose
-	points[4] = landmark[2 * 30 + 0];
-	points[5] = landmark[2 * 30 + 1];
+	points[4] = static_cast<float>(landmark[2 * 30 + 0]);
+	points[5] = static_cast<float>(landmark[2 * 30 + 1]);
 	// left-mouth-corner
-	points[6] = landmark[2 * 48 + 0];
-	points[7] = landmark[2 * 48 + 1];
+	points[6] = static_cast<float>(landmark[2 * 48 + 0]);
+	points[7] = static_cast<float>(landmark[2 * 48 + 1]);
 	// right-mouth-corner
-	points[8] = landmark[2 * 54 + 0];
-	points[9] = landmark[2 * 54 + 1];
+	points[8] = static_cast<float>(landmark[2 * 54 + 0]);
+	points[9] = static_cast<float>(landmark[2 * 54 + 1]);
 
-	// reformat
-	mat = cv::Mat(5, 2, CV_32FC1);
+	// flip y axis
 	for (int i = 0; i < 5; i++)
-	{
-		mat.ptr<float>(i)[0] = points[i * 2 + 0];
-		mat.ptr<float>(i)[1] = height - 1 - points[i * 2 + 1];
-	}
+		points[i * 2 + 1] = height - 1 - points[i * 2 + 1];
 }
 
-void Face3DMM::calculateParameters(const cv::Mat& xp, const float* x, float* t, float& s)
+void Face3DMM::calculateParameters(const float* xp, float* t, float& s)
 {
-	const int npts = xp.size[0];
-	cv::Mat A = cv::Mat::zeros(2 * npts, 8, CV_32FC1);
-	for (int i = 0; i < npts; i++)
-	{
-		A.ptr<float>(i * 2)[0] = x[i * 3];
-		A.ptr<float>(i * 2)[1] = x[i * 3 + 1];
-		A.ptr<float>(i * 2)[2] = x[i * 3 + 2];
-		A.ptr<float>(i * 2)[3] = 1;
-
-		A.ptr<float>(i * 2 + 1)[4] = x[i * 3];
-		A.ptr<float>(i * 2 + 1)[5] = x[i * 3 + 1];
-		A.ptr<float>(i * 2 + 1)[6] = x[i * 3 + 2];
-		A.ptr<float>(i * 2 + 1)[7] = 1;
-	}
-	vector<int> newshape = { 2 * npts, 1 };
-	cv::Mat b = xp.reshape(0, newshape);
-	cv::Mat k;
-	cv::solve(A.t() * A, A.t() * b, k, cv::DECOMP_CHOLESKY);
-	const float* pk = (float*)k.data;
+	static constexpr AffineFitSolver<5> solver(Landmark3D);
+	float pk[8];
+	solver.solve(xp, Landmark3D, pk);
 	float norm_R1 = sqrt(pk[0] * pk[0] + pk[1] * pk[1] + pk[2] * pk[2]);
 	t[0] = pk[3];
 	float norm_R2 = sqrt(pk[4] * pk[4] + pk[5] * pk[5] + pk[6] * pk[6]);
@@ -116,10 +214,10 @@ void Face3DMM::calculateParameters(const cv::Mat& xp, const float* x, float* t,
 	s = (norm_R1 + norm_R2) * 0.5f;
 }
 
-void Face3DMM::cropImage(const cv::Mat& image_bgr, cv::Mat& image_cropped, const float* t, const float s, const int target_size, FormatInfo& format_info)
+void Face3DMM::calculateWindow(int height, int width, const float* t, const float s, const int target_size, FormatInfo& format_info)
 {
-	const float h0 = image_bgr.rows;
-	const float w0 = image_bgr.cols;
+	const float h0 = static_cast<float>(height);
+	const float w0 = static_cast<float>(width);
 	const int w = int(w0 * s);
 	const int h = int(h0 * s);
 	int lft = int(w * 0.5f - target_size * 0.5f + (t[0] - w0 * 0.5f) * s);  // ʹó
@@ -127,71 +225,102 @@ void Face3DMM::cropImage(const cv::Mat& image_bgr, cv::Mat& image_cropped, const
 	int top = int(h * 0.5f - target_size * 0.5f + (h0 * 0.5f - t[1]) * s);
 	int bot = std::min(int(top + target_size), h);   // ֹ߽
 
-	cv::Mat image_resized;
-	cv::resize(image_bgr, image_resized, cv::Size(w, h), cv::INTER_CUBIC);
+	// clip the window into the virtual resized image (w, h)
 	lft = StdMax(lft, 0);
-	rig = StdMin(rig, image_resized.cols);
+	rig = StdMin(rig, w);
 	top = StdMax(top, 0);
-	bot = StdMin(bot, image_resized.rows);
+	bot = StdMin(bot, h);
 	format_info.h = h;
 	format_info.w = w;
+	format_info.src_h = height;
+	format_info.src_w = width;
 	format_info.lft = lft;
 	format_info.rig = rig;
 	format_info.top = top;
 	format_info.bot = bot;
-	format_info.pad_h = 0;
-	format_info.pad_w = 0;
-	image_resized(cv::Rect(lft, top, rig - lft, bot - top)).copyTo(image_cropped);
-	const int dst_h = target_size;
-	const int dst_w = target_size;
-	if (image_resized.rows < dst_h)
-	{
-		// padding to bottom
-		format_info.pad_h = dst_h - image_resized.rows;
-		cv::copyMakeBorder(image_resized, image_resized, 0, dst_h - image_resized.rows, 0, 0, BORDER_CONSTANT, 0);
-	}
-	if (image_resized.cols < dst_w)
-	{
-		// padding to right
-		format_info.pad_w = dst_w - image_resized.cols;
-		cv::copyMakeBorder(image_resized, image_resized, 0, 0, 0, dst_w - image_resized.cols, BORDER_CONSTANT, 0);
-	}
+	format_info.pad_h = StdMax(target_size - h, 0);
+	format_info.pad_w = StdMax(target_size - w, 0);
 }
 
-void Face3DMM::formatInput(const cv::Mat& image, const int* landmarks, cv::Mat& image_cropped, FormatInfo& format_info)
+void Face3DMM::cropImage(const cv::Mat& image_bgr, const FormatInfo& format_info, cv::Mat& image_cropped)
+{
+	// resample only the target window: same pixel mapping as resizing the whole
+	// image to (w, h) and cropping [lft, rig) x [top, bot) from it. Not bit-identical
+	// to that path: warpAffine quantizes the sample position to 1/32 pixel, cv::resize
+	// keeps 11-bit weights, so a pixel may move by about |gradient|/64 (at most ~4 levels
+	// on a full-range edge, 0-1 in smooth regions); an exact 2x downscale, which resize
+	// handles as area averaging, samples the same 2x2 mean up to rounding
+	const double kx = static_cast<double>(format_info.w) / image_bgr.cols;
+	const double ky = static_cast<double>(format_info.h) / image_bgr.rows;
+	cv::Mat warp_matrix = (cv::Mat_<double>(2, 3) <<
+		kx, 0., 0.5 * kx - 0.5 - format_info.lft,
+		0., ky, 0.5 * ky - 0.5 - format_info.top);
+	cv::warpAffine(image_bgr, image_cropped, warp_matrix, 
+		cv::Size(format_info.rig - format_info.lft, format_info.bot - format_info.top),
+		cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+}
+
+void Face3DMM::formatWindow(int height, int width, const int* landmarks, FormatInfo& format_info)
 {
-	int height = image.rows;
 	// estimate align parameters
-	cv::Mat points;
+	float points[10];
 	calculate5Points(landmarks, points, height);
-	// crop image
+	// window of the crop
 	float t[2], s;
-	calculateParameters(points, Landmark3D, t, s);
-	cropImage(image, image_cropped, t, this->rescale_factor / s, this->target_size, format_info);
+	calculateParameters(points, t, s);
+	calculateWindow(height, width, t, this->rescale_factor / s, this->target_size, format_info);
 	// copy landmarks
 	std::memcpy(format_info.landmark, landmarks, sizeof(format_info.landmark));
 }
 
-void Face3DMM::forward(cv::Mat& image_cropped, Face3DMMResult& result)
+void Face3DMM::formatInput(const cv::Mat& image, const int* landmarks, cv::Mat& image_cropped, FormatInfo& format_info)
+{
+	formatWindow(image.rows, image.cols, landmarks, format_info);
+	cropImage(image, format_info, image_cropped);
+}
+
+void Face3DMM::forward(const cv::Mat& image_cropped, Face3DMMResult& result, ForwardWorker& worker, int ex_threads)
 {
 	ncnn::Mat input, output;
-	XImage ximage_cropped(image_cropped);
-	// normalize
+	// normalize, read the crop in place (no XImage copy)
 	const float mean_vals[] = { 0.f, 0.f, 0.f };
 	const float norm_vals[] = { 1 / 255.f, 1 / 255.f, 1 / 255.f };
-	input = ncnn::Mat::from_pixels(ximage_cropped.data, ncnn::Mat::PIXEL_BGR2RGB, ximage_cropped.height, ximage_cropped.width);
+	input = ncnn::Mat::from_pixels(image_cropped.data, ncnn::Mat::PIXEL_BGR2RGB, 
+		image_cropped.cols, image_cropped.rows, static_cast<int>(image_cropped.step[0]), &worker.blob_allocator);
 	input.substract_mean_normalize(mean_vals, norm_vals);
 	// forward
 	ncnn::Extractor ex = net.create_extractor();
 	ex.set_light_mode(true);
+	ex.set_num_threads(ex_threads);
+	ex.set_blob_allocator(&worker.blob_allocator);
+	ex.set_workspace_allocator(&worker.workspace_allocator);
 	ex.input("in0", input);
 	ex.extract("out0", output);
-	// postprocess
+	// postprocess: write straight into the result
 	const float* data = output.channel(0).row(0);
 	std::memcpy(&result.coefficients, data, sizeof(result.coefficients));
-	//for (int n = 0; n < 257; n++) {
-	//	printf("%+.6f\n", result.coefficients.parameters[n]);
-	//}
+}
+
+void Face3DMM::forwardBatch(const std::vector<cv::Mat>& inputs, Face3DMMResultVector& result_vector)
+{
+	const int num_inputs = static_cast<int>(inputs.size());
+	assert(result_vector.size() == inputs.size());
+	if (num_inputs == 0)
+		return;
+
+	// split the threads of ncnn between the concurrent extractors
+	const int concurrency = StdMin(num_inputs, num_workers);
+	const int ex_threads = StdMax(num_threads / concurrency, 1);
+	#pragma omp parallel for num_threads(concurrency) schedule(dynamic)
+	for (int n = 0; n < num_inputs; n++)
+	{
+#ifdef _OPENMP
+		ForwardWorker& worker = *workers[omp_get_thread_num()];
+#else
+		ForwardWorker& worker = *workers[0];
+#endif
+		forward(inputs[n], result_vector[n], worker, ex_threads);
+	}
 }
 
 void Face3DMM::inference(XImage& image, Face3DMMResultVector& result_vector)
@@ -199,21 +328,183 @@ void Face3DMM::inference(XImage& image, Face3DMMResultVector& result_vector)
 	FaceDetector& face_detector = FaceDetector::getInstance();
 	FaceAlign& face_align = FaceAlign::getInstance();
 	FaceObjectVector object_vector;
+	FlightRecorder::Stage stage_detect(flight_recorder, "detect");
 	face_detector.detectSingleScale(image.data, image.height, image.width, image.channel, object_vector);
+	stage_detect.end();
 
 	const int num_objects = object_vector.size();
 	result_vector.resize(num_objects);
+	std::vector<cv::Mat> inputs(num_objects);
+	FlightRecorder::Stage stage_align(flight_recorder, "align");
 	for (int n = 0; n < num_objects; n++)
 	{
 		FaceObject* object = object_vector[n];
 		Face3DMMResult& result = result_vector[n];
+		result.identity = FaceIdentityInvalid;
+		result.regressed = true;
 		// estimate 68-points
 		face_align.pipeline(image.data, image.height, image.width, image.channel, 2, object->box, object->landmarks);
 		// format input
-		cv::Mat image_cropped;
-		formatInput(image.cv_mat, object->landmarks, image_cropped, result.format_info);
-		forward(image_cropped, result);
+		formatInput(image.cv_mat, object->landmarks, inputs[n], result.format_info);
 	}
+	stage_align.end();
 
+	// regress all faces of the frame concurrently
+	FlightRecorder::Stage stage_regress(flight_recorder, "regress");
+	forwardBatch(inputs, result_vector);
+	stage_regress.end();
+
+	if (flight_recorder != nullptr)
+	{
+		flight_recorder->recordObjects(object_vector);
+		for (const Face3DMMResult& result : result_vector)
+			flight_recorder->recordCoefficients(result.identity, result.coefficients.parameters);
+	}
 	FaceDetector::freeVector(object_vector);
 }
+
+bool Face3DMM::needRegression(const FaceObject& object, unsigned int frame_num)
+{
+	if (object.identity == FaceIdentityInvalid)
+		return true;
+	auto it = temporal_states.find(object.identity);
+	if (it == temporal_states.end())
+		return true;
+	const TemporalState& state = it->second;
+	if (frame_num < state.last_regress || frame_num - state.last_regress >= static_cast<unsigned int>(regress_interval))
+		return true;
+
+	// largest landmark motion since the last regression, relative to the face size
+	XRectangle rect;
+	rect.from(object.landmarks, FaceAlignNumPoints);
+	const float size = sqrt(StdMax(rect.area(), 1.f));
+	int motion = 0;
+	for (int n = 0; n < FaceAlignNumPoints; n++)
+	{
+		int dx = object.landmarks[n * 2 + 0] - state.landmarks[n * 2 + 0];
+		int dy = object.landmarks[n * 2 + 1] - state.landmarks[n * 2 + 1];
+		motion = StdMax(motion, dx * dx + dy * dy);
+	}
+	return sqrt(static_cast<float>(motion)) > regress_motion * size;
+}
+
+void Face3DMM::mergeRegression(const Face3DMMResult& regressed, unsigned int frame_num, Face3DMMResult& result)
+{
+	result.coefficients = regressed.coefficients;
+	if (result.identity == FaceIdentityInvalid)
+		return;
+
+	TemporalState& state = temporal_states[result.identity];
+	Face3DMMCoefficients& coefficients = result.coefficients;
+	// num_samples stops at lock_samples, the first regression of the face has none
+	const bool has_previous = state.num_samples > 0;
+	if (state.num_samples < lock_samples)
+	{
+		// average identity and texture over the first regressions, then lock them
+		if (state.num_samples == 0)
+		{
+			std::memset(state.identity_sum, 0, sizeof(state.identity_sum));
+			std::memset(state.texture_sum, 0, sizeof(state.texture_sum));
+		}
+		for (int n = 0; n < 80; n++)
+		{
+			state.identity_sum[n] += coefficients.identity[n];
+			state.texture_sum[n] += coefficients.texture[n];
+		}
+		state.num_samples++;
+	}
+	const float scale = 1.f / state.num_samples;
+	for (int n = 0; n < 80; n++)
+	{
+		coefficients.identity[n] = state.identity_sum[n] * scale;
+		coefficients.texture[n] = state.texture_sum[n] * scale;
+	}
+
+	// smooth expression, pose and lighting against the previous estimate
+	if (has_previous == true)
+	{
+		const float m = temporal_momentum;
+		const Face3DMMCoefficients& previous = state.coefficients;
+		for (int n = 0; n < 64; n++)
+			coefficients.expression[n] = m * coefficients.expression[n] + (1.f - m) * previous.expression[n];
+		for (int n = 0; n < 3; n++)
+		{
+			coefficients.angles[n] = m * coefficients.angles[n] + (1.f - m) * previous.angles[n];
+			coefficients.translation[n] = m * coefficients.translation[n] + (1.f - m) * previous.translation[n];
+		}
+		for (int n = 0; n < 27; n++)
+			coefficients.gamma[n] = m * coefficients.gamma[n] + (1.f - m) * previous.gamma[n];
+	}
+
+	state.coefficients = coefficients;
+	std::memcpy(state.landmarks, result.format_info.landmark, sizeof(state.landmarks));
+	state.last_regress = frame_num;
+}
+
+void Face3DMM::inferenceTemporal(XImage& image, unsigned int frame_num, Face3DMMResultVector& result_vector)
+{
+	FlightRecorder::Stage stage_tracking(flight_recorder, "tracking");
+	face_tracker.pipelineUpdate(image.data, image.height, image.width, image.channel, frame_num, tracked_objects);
+	stage_tracking.end();
+
+	// the crop always follows the tracked landmarks, only some faces are regressed
+	const int num_objects = tracked_objects.size();
+	result_vector.resize(num_objects);
+	std::vector<int> regress_index;
+	std::vector<cv::Mat> inputs;
+	FlightRecorder::Stage stage_format(flight_recorder, "format");
+	for (int n = 0; n < num_objects; n++)
+	{
+		const FaceObject& object = *tracked_objects[n];
+		Face3DMMResult& result = result_vector[n];
+		result.identity = object.identity;
+		result.regressed = needRegression(object, frame_num);
+		formatWindow(image.height, image.width, object.landmarks, result.format_info);
+		if (result.regressed == true)
+		{
+			inputs.emplace_back();
+			cropImage(image.cv_mat, result.format_info, inputs.back());
+			regress_index.push_back(n);
+		}
+		else
+		{
+			// hold the locked and smoothed coefficients, the aligned crop carries the rigid motion,
+			// then follow pose and expression with the tracked landmarks when a fitting is given
+			TemporalState& state = temporal_states[object.identity];
+			result.coefficients = state.coefficients;
+			if (face_fitting != nullptr && face_fitting->isReady())
+			{
+				face_fitting->fit(result.format_info, image.height, image.width, result.coefficients);
+				state.coefficients = result.coefficients;
+			}
+		}
+	}
+
+	stage_format.end();
+
+	// regress the selected faces concurrently
+	FlightRecorder::Stage stage_regress(flight_recorder, "regress");
+	Face3DMMResultVector regressed_vector(inputs.size());
+	forwardBatch(inputs, regressed_vector);
+	for (int k = 0; k < static_cast<int>(regress_index.size()); k++)
+		mergeRegression(regressed_vector[k], frame_num, result_vector[regress_index[k]]);
+	stage_regress.end();
+
+	if (flight_recorder != nullptr)
+	{
+		flight_recorder->recordObjects(tracked_objects);
+		for (const Face3DMMResult& result : result_vector)
+			flight_recorder->recordCoefficients(result.identity, result.coefficients.parameters);
+	}
+
+	// drop the states of lost faces
+	for (auto it = temporal_states.begin(); it != temporal_states.end(); )
+	{
+		bool alive = false;
+		for (const FaceObject* object : tracked_objects)
+			alive = alive || (object->identity == it->first);
+		if (alive == false)
+			it = temporal_states.erase(it);
+		else ++it;
+	}
+}
@@ -12,11 +12,15 @@
 #include "tools/ximage.h"
 #include "face_base/face_tracking.h"
 
+class FaceFitting;
+class FlightRecorder;
 
 struct FormatInfo
 {
     // w0 * s, h0 * s
     int h, w;
+    // source image h0, w0
+    int src_h, src_w;
     // padding
     int pad_w, pad_h;
     // face box
@@ -47,6 +51,10 @@ struct Face3DMMResult
     FormatInfo format_info;
     // 3dmm coefficient
     Face3DMMCoefficients coefficients;
+    // tracked identity, FaceIdentityInvalid without tracking
+    int identity = FaceIdentityInvalid;
+    // whether the coefficients come from the network in this frame
+    bool regressed = true;
 };
 
 typedef std::vector<Face3DMMResult> Face3DMMResultVector;
@@ -69,18 +77,61 @@ protected:
     const int target_size = 224;
     float rescale_factor = 102.f;
     FaceTracking face_tracker;
+protected:
+    // each concurrent regression owns its allocators, reused across frames; the layers of
+    // a multi-threaded extractor take workspace from their own omp threads, so that pool is locked
+    struct ForwardWorker
+    {
+        ncnn::UnlockedPoolAllocator blob_allocator;
+        ncnn::PoolAllocator workspace_allocator;
+    };
+    int num_workers = 4;
+    std::vector<std::unique_ptr<ForwardWorker>> workers;
+protected:
+    // temporal mode: identity and texture are locked per tracked face, the network
+    // only runs every regress_interval frames or on large landmark motion
+    struct TemporalState
+    {
+        Face3DMMCoefficients coefficients;
+        float identity_sum[80];
+        float texture_sum[80];
+        int num_samples = 0;
+        int landmarks[136];
+        unsigned int last_regress = 0;
+    };
+    int regress_interval = 8;
+    float regress_motion = 0.05f;
+    int lock_samples = 3;
+    float temporal_momentum = 0.6f;
+    FaceObjectVector tracked_objects;
+    std::map<int, TemporalState> temporal_states;
+    // optional landmark fitting between two regressions
+    const FaceFitting* face_fitting = nullptr;
+    // optional stage timeline, tracked faces and coefficients of every frame
+    FlightRecorder* flight_recorder = nullptr;
 
 public:
     void initialize();
     void initialize(const char* path_param, const char* path_bin);
+    void setNumWorkers(int num_workers);
+    void setTemporalConfig(int regress_interval, float regress_motion, int lock_samples, float momentum);
+    void setTrackingMode(FaceTracking::FaceTrackingMode mode);
+    void setFitting(const FaceFitting* face_fitting);
+    void setRecorder(FlightRecorder* flight_recorder);
     void inference(XImage& image, Face3DMMResultVector& result_vector);
+    void inferenceTemporal(XImage& image, unsigned int frame_num, Face3DMMResultVector& result_vector);
+    void forwardBatch(const std::vector<cv::Mat>& inputs, Face3DMMResultVector& result_vector);
 protected:
     void formatInput(const cv::Mat& image, const int* landmarks, cv::Mat& image_cropped, FormatInfo& format_info);
-    void calculate5Points(const int* landmark, cv::Mat& mat, int height);
-    void calculateParameters(const cv::Mat& xp, const float* x, float* t, float& s);
-    void cropImage(const cv::Mat& image_bgr, cv::Mat& image_cropped, 
-        const float* t, const float s, const int target_size, FormatInfo& format_info);
-    void forward(cv::Mat &input, Face3DMMResult& result);
+    void calculate5Points(const int* landmark, float* points, int height);
+    void calculateParameters(const float* xp, float* t, float& s);
+    void calculateWindow(int height, int width, const float* t, const float s, 
+        const int target_size, FormatInfo& format_info);
+    void cropImage(const cv::Mat& image_bgr, const FormatInfo& format_info, cv::Mat& image_cropped);
+    void formatWindow(int height, int width, const int* landmarks, FormatInfo& format_info);
+    void forward(const cv::Mat& input, Face3DMMResult& result, ForwardWorker& worker, int ex_threads);
+    bool needRegression(const FaceObject& object, unsigned int frame_num);
+    void mergeRegression(const Face3DMMResult& regressed, unsigned int frame_num, Face3DMMResult& result);
 };
 
 #endif
\ No newline at end of file
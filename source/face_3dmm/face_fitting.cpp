@@ -0,0 +1,252 @@
+
+#include <cmath>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+#include "face_fitting.h"
+#include "face_render.h"
+
+
+FaceFitting::FaceFitting()
+{
+    normal_h.resize(NumParameters * NumParameters);
+    jacobian.resize(2 * NumParameters);
+    normal_a.resize(NumParameters * NumParameters);
+    gradient.resize(NumParameters);
+}
+
+FaceFitting::~FaceFitting()
+{
+
+}
+
+void FaceFitting::initialize(const FaceRender& face_render)
+{
+    // the key point subset is stored as (coefficients, 3 * points), transpose it per point
+    const FaceVertexSubset& subset = face_render.key_subset;
+    assert(static_cast<int>(subset.indices.size()) == NumPoints);
+    assert(subset.id_base.rows == NumIdentity && subset.exp_base.rows == NumExpression);
+
+    key_mean.resize(NumPoints * 3);
+    key_identity.resize(NumPoints * 3 * NumIdentity);
+    key_expression.resize(NumPoints * 3 * NumExpression);
+    for (int row = 0; row < NumPoints * 3; row++) {
+        key_mean[row] = subset.mean_shape.ptr<float>(0)[row];
+        for (int j = 0; j < NumIdentity; j++)
+            key_identity[row * NumIdentity + j] = subset.id_base.ptr<float>(j)[row];
+        for (int j = 0; j < NumExpression; j++)
+            key_expression[row * NumExpression + j] = subset.exp_base.ptr<float>(j)[row];
+    }
+
+    focal = face_render.persc_proj.ptr<float>(0)[0];
+    center = face_render.persc_proj.ptr<float>(2)[0];
+    camera_distance = face_render.camera_distance;
+    target_size = face_render.rast_w;
+    ready = true;
+}
+
+void FaceFitting::setConfig(int num_iterations, float expression_prior)
+{
+    this->num_iterations = num_iterations;
+    this->expression_prior = expression_prior;
+}
+
+bool FaceFitting::isReady() const
+{
+    return ready;
+}
+
+void FaceFitting::toModelSpace(const FormatInfo& format_info, int source_height, int source_width, float* observed) const
+{
+    // source image --> crop (pixel centers as in Face3DMM::cropImage) --> projection with y upward
+    const float kx = static_cast<float>(format_info.w) / source_width;
+    const float ky = static_cast<float>(format_info.h) / source_height;
+    for (int k = 0; k < NumPoints; k++) {
+        float x = (format_info.landmark[k * 2 + 0] + 0.5f) * kx - 0.5f - format_info.lft;
+        float y = (format_info.landmark[k * 2 + 1] + 0.5f) * ky - 0.5f - format_info.top;
+        observed[k * 2 + 0] = x;
+        observed[k * 2 + 1] = (target_size - 1) - y;
+    }
+}
+
+float FaceFitting::fit(const FormatInfo& format_info, int source_height, int source_width, Face3DMMCoefficients& coefficients) const
+{
+    assert(ready);
+    float observed[NumPoints * 2];
+    toModelSpace(format_info, source_height, source_width, observed);
+    return solve(observed, coefficients);
+}
+
+float FaceFitting::solve(const float* observed, Face3DMMCoefficients& coefficients) const
+{
+    const int P = NumParameters;
+    const int E = NumExpression;
+
+    // identity part of the key points is fixed during the fit
+    float base[NumPoints * 3];
+    for (int row = 0; row < NumPoints * 3; row++) {
+        const float* b = &key_identity[row * NumIdentity];
+        float sum = key_mean[row];
+        for (int j = 0; j < NumIdentity; j++)
+            sum += b[j] * coefficients.identity[j];
+        base[row] = sum;
+    }
+
+    float expression_init[NumExpression];
+    std::memcpy(expression_init, coefficients.expression, sizeof(expression_init));
+
+    // normal matrix accumulated in float (vectorized rank-2 updates), solved in double
+    std::vector<float>& H = normal_h;
+    std::vector<float>& J = jacobian;
+    std::vector<double>& A = normal_a;
+    std::vector<double>& g = gradient;
+    float rms = 0.f;
+    for (int iter = 0; iter <= num_iterations; iter++) {
+        // rotation R = Rz * Ry * Rx and its partial derivatives
+        const float* a = coefficients.angles;
+        const float cx = cos(a[0]), sx = sin(a[0]);
+        const float cy = cos(a[1]), sy = sin(a[1]);
+        const float cz = cos(a[2]), sz = sin(a[2]);
+        const float Rx[9] = { 1, 0, 0, 0, cx, -sx, 0, sx, cx };
+        const float Ry[9] = { cy, 0, sy, 0, 1, 0, -sy, 0, cy };
+        const float Rz[9] = { cz, -sz, 0, sz, cz, 0, 0, 0, 1 };
+        const float dRx[9] = { 0, 0, 0, 0, -sx, -cx, 0, cx, -sx };
+        const float dRy[9] = { -sy, 0, cy, 0, 0, 0, -cy, 0, -sy };
+        const float dRz[9] = { -sz, -cz, 0, cz, -sz, 0, 0, 0, 0 };
+        auto mul = [](const float* x, const float* y, float* z) {
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++)
+                    z[i * 3 + j] = x[i * 3 + 0] * y[0 * 3 + j] + x[i * 3 + 1] * y[1 * 3 + j] + x[i * 3 + 2] * y[2 * 3 + j];
+        };
+        float ZY[9], R[9], dR[3][9], tmp[9];
+        mul(Rz, Ry, ZY);
+        mul(ZY, Rx, R);
+        mul(ZY, dRx, dR[0]);
+        mul(Rz, dRy, tmp);
+        mul(tmp, Rx, dR[1]);
+        mul(dRz, Ry, tmp);
+        mul(tmp, Rx, dR[2]);
+
+        // normal equations, the expression prior is a diagonal term
+        std::fill(H.begin(), H.end(), 0.f);
+        std::fill(g.begin(), g.end(), 0.);
+        double error = 0.;
+        for (int k = 0; k < NumPoints; k++) {
+            const float* eb = &key_expression[k * 3 * E];
+            float S[3];
+            for (int c = 0; c < 3; c++) {
+                float sum = base[k * 3 + c];
+                for (int j = 0; j < E; j++)
+                    sum += eb[c * E + j] * coefficients.expression[j];
+                S[c] = sum;
+            }
+            float V[3];
+            for (int c = 0; c < 3; c++)
+                V[c] = R[c * 3 + 0] * S[0] + R[c * 3 + 1] * S[1] + R[c * 3 + 2] * S[2] + coefficients.translation[c];
+
+            // u = f * X / (d - Z) + c, v = f * Y / (d - Z) + c
+            const float inv_z = 1.f / (camera_distance - V[2]);
+            const float u = focal * V[0] * inv_z + center;
+            const float v = focal * V[1] * inv_z + center;
+            const float ru = observed[k * 2 + 0] - u;
+            const float rv = observed[k * 2 + 1] - v;
+            error += ru * ru + rv * rv;
+            if (iter == num_iterations)
+                continue;
+
+            // derivatives of (u, v) with respect to the vertex
+            const float fz = focal * inv_z;
+            const float du[3] = { fz, 0.f, fz * V[0] * inv_z };
+            const float dv[3] = { 0.f, fz, fz * V[1] * inv_z };
+            float* Ju = J.data();
+            float* Jv = J.data() + P;
+            for (int i = 0; i < 3; i++) {
+                // angles: dV = dR * S
+                float dV[3];
+                for (int c = 0; c < 3; c++)
+                    dV[c] = dR[i][c * 3 + 0] * S[0] + dR[i][c * 3 + 1] * S[1] + dR[i][c * 3 + 2] * S[2];
+                Ju[i] = du[0] * dV[0] + du[2] * dV[2];
+                Jv[i] = dv[1] * dV[1] + dv[2] * dV[2];
+                // translation: dV = I
+                Ju[3 + i] = du[i];
+                Jv[3 + i] = dv[i];
+            }
+            // expression: dV = R * expression_base, folded as (du * R) * base
+            float uR[3], vR[3];
+            for (int c = 0; c < 3; c++) {
+                uR[c] = du[0] * R[0 * 3 + c] + du[1] * R[1 * 3 + c] + du[2] * R[2 * 3 + c];
+                vR[c] = dv[0] * R[0 * 3 + c] + dv[1] * R[1 * 3 + c] + dv[2] * R[2 * 3 + c];
+            }
+            for (int j = 0; j < E; j++) {
+                Ju[6 + j] = uR[0] * eb[0 * E + j] + uR[1] * eb[1 * E + j] + uR[2] * eb[2 * E + j];
+                Jv[6 + j] = vR[0] * eb[0 * E + j] + vR[1] * eb[1 * E + j] + vR[2] * eb[2 * E + j];
+            }
+
+            // upper triangle of H += Ju^T Ju + Jv^T Jv, every row is a contiguous axpy
+            for (int i = 0; i < P; i++) {
+                const float a = Ju[i], b = Jv[i];
+                g[i] += a * ru + b * rv;
+                float* Hi = &H[i * P];
+                for (int j = i; j < P; j++)
+                    Hi[j] += a * Ju[j] + b * Jv[j];
+            }
+        }
+        rms = static_cast<float>(sqrt(error / NumPoints));
+        if (iter == num_iterations)
+            break;
+
+        for (int i = 0; i < P; i++) {
+            for (int j = i; j < P; j++)
+                A[i * P + j] = A[j * P + i] = H[i * P + j];
+            A[i * P + i] += damping;
+        }
+        for (int j = 0; j < E; j++) {
+            A[(6 + j) * P + 6 + j] += expression_prior;
+            g[6 + j] -= expression_prior * (coefficients.expression[j] - expression_init[j]);
+        }
+
+        // cholesky, A = L * L^T in place
+        bool positive = true;
+        for (int j = 0; j < P && positive; j++) {
+            double d = A[j * P + j];
+            for (int k = 0; k < j; k++)
+                d -= A[j * P + k] * A[j * P + k];
+            if (d <= 0.) {
+                positive = false;
+                break;
+            }
+            d = sqrt(d);
+            A[j * P + j] = d;
+            for (int i = j + 1; i < P; i++) {
+                double s = A[i * P + j];
+                for (int k = 0; k < j; k++)
+                    s -= A[i * P + k] * A[j * P + k];
+                A[i * P + j] = s / d;
+            }
+        }
+        if (positive == false)
+            break;
+        for (int i = 0; i < P; i++) {
+            double s = g[i];
+            for (int k = 0; k < i; k++)
+                s -= A[i * P + k] * g[k];
+            g[i] = s / A[i * P + i];
+        }
+        for (int i = P - 1; i >= 0; i--) {
+            double s = g[i];
+            for (int k = i + 1; k < P; k++)
+                s -= A[k * P + i] * g[k];
+            g[i] = s / A[i * P + i];
+        }
+
+        // update
+        for (int i = 0; i < 3; i++) {
+            coefficients.angles[i] += static_cast<float>(g[i]);
+            coefficients.translation[i] += static_cast<float>(g[3 + i]);
+        }
+        for (int j = 0; j < E; j++)
+            coefficients.expression[j] += static_cast<float>(g[6 + j]);
+    }
+    return rms;
+}
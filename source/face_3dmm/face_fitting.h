@@ -0,0 +1,58 @@
+
+#ifndef __Face_Fitting__
+#define __Face_Fitting__
+
+#include <vector>
+#include "face_3dmm.h"
+
+class FaceRender;
+
+
+// Gauss-Newton fitting of angles, translation and expression to the 68 tracked
+// landmarks. Only the key point rows of the BFM bases are used, identity, texture
+// and lighting stay as given, so one iteration costs a 136x70 Jacobian.
+class FaceFitting
+{
+public:
+    FaceFitting();
+    ~FaceFitting();
+
+public:
+    static const int NumPoints = 68;
+    static const int NumIdentity = 80;
+    static const int NumExpression = 64;
+    static const int NumParameters = 3 + 3 + NumExpression;  // angles, translation, expression
+
+protected:
+    bool ready = false;
+    int num_iterations = 3;
+    // weight (pixel^2) pulling the expression to its initial value, and damping of all parameters
+    float expression_prior = 10.f;
+    float damping = 1e-3f;
+    // camera, the same as FaceRender::persc_proj
+    float focal = 1015.f;
+    float center = 112.f;
+    float camera_distance = 10.f;
+    int target_size = 224;
+    // bases at the key points, row (point * 3 + xyz)
+    std::vector<float> key_mean;        // 68*3
+    std::vector<float> key_identity;    // 68*3, 80
+    std::vector<float> key_expression;  // 68*3, 64
+    // normal equations of solve, reused across frames, so one fitter serves one thread
+    mutable std::vector<float> normal_h;    // P*P
+    mutable std::vector<float> jacobian;    // 2*P
+    mutable std::vector<double> normal_a;   // P*P
+    mutable std::vector<double> gradient;   // P
+
+protected:
+    void toModelSpace(const FormatInfo& format_info, int source_height, int source_width, float* observed) const;
+    float solve(const float* observed, Face3DMMCoefficients& coefficients) const;
+
+public:
+    void initialize(const FaceRender& face_render);
+    void setConfig(int num_iterations, float expression_prior);
+    bool isReady() const;
+    float fit(const FormatInfo& format_info, int source_height, int source_width, Face3DMMCoefficients& coefficients) const;
+};
+
+#endif
@@ -1,4 +1,5 @@
 ﻿
+#include <cstring>
 #include <opencv2/opencv.hpp>
 #include <opencv2/dnn.hpp>
 #include "face_render.h"
@@ -59,113 +60,306 @@ void FaceRender::initialize(const char* path_bfm)
     // inplace operation: mat.col return a data view
     cv::Mat last_col = bfm_uv.col(1);
     last_col = 1.0f - last_col;
+
+    // 拓扑和uv不变, 预先按三角形展开uv, 渲染时每个像素只读一段连续内存
+    bfm_uv = bfm_uv.isContinuous() ? bfm_uv : bfm_uv.clone();
+    tri = tri.isContinuous() ? tri : tri.clone();
+    tri_uv.create(tri.rows, 6, CV_32FC1);
+    render_triangle_table(bfm_uv.ptr<float>(), bfm_uv.rows, bfm_uv.cols, tri.ptr<int>(), tri.rows, tri_uv.ptr<float>());
+
+    // 预先收集68个关键点的基
+    cv::Mat key_index;
+    key_points.reshape(1, 1).convertTo(key_index, CV_32S);
+    gatherSubset(std::vector<int>(key_index.ptr<int>(0), key_index.ptr<int>(0) + key_index.cols), key_subset);
+
+    loadLevels(container);
 }
 
-void FaceRender::computeShape(Face3DMMCoefficientsMatrix& coefficients, FaceParameter& param)
+void FaceRender::loadLevels(const XArrayContainer& container)
 {
-    cv::Mat id = coefficients.identity * this->id_base;
-    cv::Mat exp = coefficients.expression * this->exp_base;
-    param.face_shape = id + exp + this->mean_shape;
-    std::vector<int> new_shape = { 35709, 3 };
-    param.face_shape = param.face_shape.reshape(0, new_shape);
+    // 第0层: 完整网格, 只共享数据不拷贝
+    mesh_levels.resize(1);
+    FaceMeshLevel& full = mesh_levels[0];
+    full.max_face_size = FLT_MAX;
+    full.subset.indices.clear();
+    full.subset.mean_shape = mean_shape;
+    full.subset.id_base = id_base;
+    full.subset.exp_base = exp_base;
+    full.tri = tri;
+    full.point_buf = point_buf;
+    full.bfm_uv = bfm_uv;
+    full.tri_uv = tri_uv;
+
+    // 简化网格(可选): lod{k}_size 适用的最大人脸尺寸, lod{k}_index 保留的顶点(完整网格中的序号),
+    // lod{k}_tri / lod{k}_point_buf 以保留顶点重新编号的拓扑
+    for (int k = 1; container.hasArray(cv::format("lod%d_index", k)); k++) {
+        cv::Mat size, index;
+        FaceMeshLevel level;
+        transformXArray2Matrix(container[cv::format("lod%d_size", k)], size);
+        transformXArray2Matrix(container[cv::format("lod%d_index", k)], index);
+        transformXArray2Matrix(container[cv::format("lod%d_tri", k)], level.tri);
+        transformXArray2Matrix(container[cv::format("lod%d_point_buf", k)], level.point_buf);
+        size.convertTo(size, CV_32F);
+        level.max_face_size = size.ptr<float>(0)[0];
+        index.reshape(1, 1).convertTo(index, CV_32S);
+        level.tri = level.tri.isContinuous() ? level.tri : level.tri.clone();
+        CV_Assert(level.point_buf.rows == index.cols && level.tri.cols == 3);
+
+        gatherSubset(std::vector<int>(index.ptr<int>(0), index.ptr<int>(0) + index.cols), level.subset);
+        level.bfm_uv.create(index.cols, 2, CV_32FC1);
+        for (int i = 0; i < index.cols; i++)
+            bfm_uv.row(index.ptr<int>(0)[i]).copyTo(level.bfm_uv.row(i));
+        level.tri_uv.create(level.tri.rows, 6, CV_32FC1);
+        render_triangle_table(level.bfm_uv.ptr<float>(), level.bfm_uv.rows, level.bfm_uv.cols,
+            level.tri.ptr<int>(), level.tri.rows, level.tri_uv.ptr<float>());
+        mesh_levels.push_back(level);
+    }
 }
 
-void FaceRender::computeRotation(Face3DMMCoefficientsMatrix& coefficients, FaceParameter& param)
+void FaceRender::setAdaptiveLevel(bool enable)
 {
-    const cv::Mat& angles = coefficients.angles;
-    float x = angles.ptr<float>(0)[0];
-    float y = angles.ptr<float>(0)[1];
-    float z = angles.ptr<float>(0)[2];
-    //const float cos_x = std::cos(x), sin_x = std::sin(x);
-    //const float cos_y = std::cos(y), sin_y = std::sin(y);
-    //const float cos_z = std::cos(z), sin_x = std::sin(z);
-    cv::Mat rot_x = (cv::Mat_<float>(3, 3) << 1, 0, 0, 0, cos(x), -sin(x), 0, sin(x), cos(x));
-    cv::Mat rot_y = (cv::Mat_<float>(3, 3) << cos(y), 0, sin(y), 0, 1, 0, -sin(y), 0, cos(y));
-    cv::Mat rot_z = (cv::Mat_<float>(3, 3) << cos(z), -sin(z), 0, sin(z), cos(z), 0, 0, 0, 1);
+    adaptive_level = enable;
+}
 
-    cv::Mat rot = rot_z * rot_y * rot_x;
-    param.rotation = rot.t();
+void FaceRender::setHarmonicShading(bool enable)
+{
+    harmonic_shading = enable;
 }
 
-void FaceRender::transform(Face3DMMCoefficientsMatrix& coefficients, FaceParameter& param)
+int FaceRender::selectLevel(const Face3DMMResult& result_3dmm) const
+{
+    if (adaptive_level == false)
+        return 0;
+
+    // 人脸在原图中的尺寸: 关键点的范围
+    const int* landmark = result_3dmm.format_info.landmark;
+    int min_x = landmark[0], max_x = landmark[0];
+    int min_y = landmark[1], max_y = landmark[1];
+    for (int i = 1; i < 68; i++) {
+        min_x = StdMin(min_x, landmark[i * 2 + 0]);
+        max_x = StdMax(max_x, landmark[i * 2 + 0]);
+        min_y = StdMin(min_y, landmark[i * 2 + 1]);
+        max_y = StdMax(max_y, landmark[i * 2 + 1]);
+    }
+    const float face_size = static_cast<float>(StdMax(max_x - min_x, max_y - min_y));
+
+    // 最粗的可用层级
+    for (int n = static_cast<int>(mesh_levels.size()) - 1; n > 0; n--) {
+        if (face_size <= mesh_levels[n].max_face_size)
+            return n;
+    }
+    return 0;
+}
+
+void FaceRender::gatherSubset(const std::vector<int>& indices, FaceVertexSubset& subset) const
+{
+    const int n = static_cast<int>(indices.size());
+    subset.indices = indices;
+    subset.mean_shape.create(1, n * 3, CV_32F);
+    subset.id_base.create(id_base.rows, n * 3, CV_32F);
+    subset.exp_base.create(exp_base.rows, n * 3, CV_32F);
+    for (int k = 0; k < n; k++) {
+        // 每个顶点占连续的xyz三列
+        for (int c = 0; c < 3; c++) {
+            const int src = indices[k] * 3 + c;
+            const int dst = k * 3 + c;
+            subset.mean_shape.ptr<float>(0)[dst] = mean_shape.ptr<float>(0)[src];
+            for (int j = 0; j < id_base.rows; j++)
+                subset.id_base.ptr<float>(j)[dst] = id_base.ptr<float>(j)[src];
+            for (int j = 0; j < exp_base.rows; j++)
+                subset.exp_base.ptr<float>(j)[dst] = exp_base.ptr<float>(j)[src];
+        }
+    }
+}
+
+void FaceRender::computeShape(Face3DMMCoefficientsMatrix& coefficients, const FaceMeshLevel& mesh, FaceParameter& param)
+{
+    // 直接写入复用的缓冲区: shape = id * id_base + mean + exp * exp_base
+    const FaceVertexSubset& base = mesh.subset;
+    cv::gemm(coefficients.identity, base.id_base, 1.0, base.mean_shape, 1.0, param.shape_flat);
+    cv::gemm(coefficients.expression, base.exp_base, 1.0, cv::noArray(), 0.0, param.shape_expression);
+    cv::add(param.shape_flat, param.shape_expression, param.shape_flat);
+    param.face_shape = param.shape_flat.reshape(0, mesh.point_buf.rows);
+}
+
+void FaceRender::computeRotation(Face3DMMCoefficientsMatrix& coefficients, FaceParameter& param)
 {
-    // c++里没有numpy的广播机制,所以这里需要用repeat
-    cv::Mat translation = cv::repeat(coefficients.translation, param.face_shape.size[0], 1);
-    param.face_vertex = param.face_shape * param.rotation + translation;
+    // R = Rz * Ry * Rx 直接展开, 保存的是转置(顶点为行向量)
+    const cv::Mat& angles = coefficients.angles;
+    const float x = angles.ptr<float>(0)[0];
+    const float y = angles.ptr<float>(0)[1];
+    const float z = angles.ptr<float>(0)[2];
+    const float cx = std::cos(x), sx = std::sin(x);
+    const float cy = std::cos(y), sy = std::sin(y);
+    const float cz = std::cos(z), sz = std::sin(z);
+    param.rotation.create(3, 3, CV_32FC1);
+    float* r = param.rotation.ptr<float>(0);
+    r[0] = cz * cy;
+    r[1] = sz * cy;
+    r[2] = -sy;
+    r[3] = cz * sy * sx - sz * cx;
+    r[4] = sz * sy * sx + cz * cx;
+    r[5] = cy * sx;
+    r[6] = cz * sy * cx + sz * sx;
+    r[7] = sz * sy * cx - cz * sx;
+    r[8] = cy * cx;
 }
 
-void FaceRender::toCamera(Face3DMMCoefficientsMatrix& coefficients, FaceParameter& param)
+void FaceRender::transform(Face3DMMCoefficientsMatrix& coefficients, FaceParameter& param)
 {
-    cv::Mat& face_vertex = param.face_vertex;
-    face_vertex.col(2) = this->camera_distance - face_vertex.col(2);
+    // 旋转, 平移和相机坐标(z = d - z)合并为一个仿射变换, 一次遍历所有顶点
+    const float* r = param.rotation.ptr<float>(0);
+    const float* t = coefficients.translation.ptr<float>(0);
+    const float matrix[12] = {
+        r[0], r[3], r[6], t[0],
+        r[1], r[4], r[7], t[1],
+        -r[2], -r[5], -r[8], camera_distance - t[2],
+    };
+    cv::Mat& face_shape = param.face_shape;
+    face_shape = face_shape.isContinuous() ? face_shape : face_shape.clone();
+    param.face_vertex.create(face_shape.rows, 3, CV_32FC1);
+    render_transform(face_shape.ptr<float>(), face_shape.rows, matrix, nullptr, param.face_vertex.ptr<float>(), nullptr);
 }
 
 void FaceRender::computeTexture(Face3DMMCoefficientsMatrix& coefficients, FaceParameter& param)
 {
-    cv::Mat tex = coefficients.texture * this->tex_base;
-    cv::Mat face_texture = tex + this->tex_mean;
-    face_texture.convertTo(param.face_texture, CV_32F, 1.0f / 255.f);
-    std::vector<int> new_shape = { 35709, 3 };
-    param.face_texture = param.face_texture.reshape(0, new_shape);
+    // face_texture = (texture * tex_base + tex_mean) / 255, RGB
+    cv::gemm(coefficients.texture, this->tex_base, 1.0 / 255.0, this->tex_mean, 1.0 / 255.0, param.face_texture);
+    param.face_texture = param.face_texture.reshape(0, this->tex_base.cols / 3);
 }
 
-void FaceRender::computeNorm(Face3DMMCoefficientsMatrix& coefficients, FaceParameter& param)
+void FaceRender::computeNorm(Face3DMMCoefficientsMatrix& coefficients, const FaceMeshLevel& mesh, FaceParameter& param)
 {
     cv::Mat& face_shape = param.face_shape;
-    const int tri_shape[] = { 70789, 3 };
-    cv::Mat face_norm = cv::Mat::zeros(tri_shape[0] + 1, 3, CV_32FC1);
+    const cv::Mat& tri = mesh.tri;
+    const cv::Mat& point_buf = mesh.point_buf;
+    const int tri_shape[] = { tri.rows, 3 };
+    // 最后一行为0, point_buf用它来补齐
+    param.tri_norm.create(tri_shape[0] + 1, 3, CV_32FC1);
+    cv::Mat& face_norm = param.tri_norm;
+    face_norm.row(tri_shape[0]).setTo(0.f);
     #pragma omp parallel for num_threads(4)
     for (int i = 0; i < tri_shape[0]; i++) {
-        const cv::Mat v1 = face_shape.row(tri.ptr<int>(i, 0)[0]);
-        const cv::Mat v2 = face_shape.row(tri.ptr<int>(i, 1)[0]);
-        const cv::Mat v3 = face_shape.row(tri.ptr<int>(i, 2)[0]);
-        cv::Mat e1 = v1 - v2;
-        cv::Mat e2 = v2 - v3;
-        cv::Mat n = e1.cross(e2);
-        face_norm.row(i) = n / cv::norm(n);
+        const int* t = tri.ptr<int>(i);
+        const float* v1 = face_shape.ptr<float>(t[0]);
+        const float* v2 = face_shape.ptr<float>(t[1]);
+        const float* v3 = face_shape.ptr<float>(t[2]);
+        const float e1[3] = { v1[0] - v2[0], v1[1] - v2[1], v1[2] - v2[2] };
+        const float e2[3] = { v2[0] - v3[0], v2[1] - v3[1], v2[2] - v3[2] };
+        const float n[3] = { 
+            e1[1] * e2[2] - e1[2] * e2[1], 
+            e1[2] * e2[0] - e1[0] * e2[2], 
+            e1[0] * e2[1] - e1[1] * e2[0] };
+        const float norm = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        float* out = face_norm.ptr<float>(i);
+        out[0] = n[0] / norm;
+        out[1] = n[1] / norm;
+        out[2] = n[2] / norm;
     }
 
-    const int point_buf_shape[] = { 35709, 8 };
-    cv::Mat vertex_norm = cv::Mat::zeros(point_buf_shape[0], 3, CV_32FC1);
+    const int point_buf_shape[] = { point_buf.rows, point_buf.cols };
+    param.vertex_norm.create(point_buf_shape[0], 3, CV_32FC1);
+    cv::Mat& vertex_norm = param.vertex_norm;
     #pragma omp parallel for num_threads(4)
     for (int i = 0; i < point_buf_shape[0]; i++) {
-        cv::Mat vs = cv::Mat::zeros(point_buf_shape[1], 3, CV_32FC1);
+        // 相邻三角形法向量求和后归一化
+        const int* buf = point_buf.ptr<int>(i);
+        float sum[3] = { 0.f, 0.f, 0.f };
         for (int j = 0; j < point_buf_shape[1]; j++) {
-            face_norm.row(point_buf.ptr<int>(i, j)[0]).copyTo(vs.row(j));
+            const float* n = face_norm.ptr<float>(buf[j]);
+            sum[0] += n[0];
+            sum[1] += n[1];
+            sum[2] += n[2];
         }
-        cv::Mat vs_colsum;
-        cv::reduce(vs, vs_colsum, 0, cv::REDUCE_SUM, CV_32FC1);   // 沿着列求和
-        vertex_norm.row(i) = vs_colsum / cv::norm(vs_colsum);
+        const float norm = std::sqrt(sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2]);
+        float* out = vertex_norm.ptr<float>(i);
+        out[0] = sum[0] / norm;
+        out[1] = sum[1] / norm;
+        out[2] = sum[2] / norm;
     }
 
-    param.face_norm_roted = vertex_norm * param.rotation;
+    cv::gemm(vertex_norm, param.rotation, 1.0, cv::noArray(), 0.0, param.face_norm_roted);
 }
 
 void FaceRender::computeGrayShadingWithDirectionLight(FaceParameter& param)
 {
-    const cv::Mat& face_texture = cv::Mat::ones(35709, 3, CV_32FC1) * 0.78; // param.face_texture(35709,3)
+    const float face_texture = 0.78f; // param.face_texture(35709,3)
     const cv::Mat& normals = param.face_norm_roted;
-    param.gray_shading = cv::Mat(normals.rows, 3, CV_32FC1);
+    param.gray_shading.create(normals.rows, 3, CV_32FC1);
     cv::Mat& gray_shading = param.gray_shading;
-    float gray_shading_max = 0;
+
+    // 归一化后的光照方向
+    float directions[5][3];
+    for (int j = 0; j < 5; j++) {
+        const float x = light_direction_norm[j];
+        for (int c = 0; c < 3; c++)
+            directions[j][c] = this->light_direction.ptr<float>(j)[c] / x;
+    }
+
     for (int i = 0; i < normals.rows; i++) {
+        const float* n = normals.ptr<float>(i);
         float sum_[3] = { 0.f, 0.f, 0.f };
         for (int j = 0; j < 5; j++) {
-            const float x = light_direction_norm[j];
-            float y = cv::sum(normals.row(i).mul(this->light_direction.row(j) / x))[0];
+            float y = n[0] * directions[j][0] + n[1] * directions[j][1] + n[2] * directions[j][2];
             y = std::max(std::min(y, 1.f), 0.f);
             sum_[0] += (y * this->light_intensities.ptr<float>(j)[0]);
             sum_[1] += (y * this->light_intensities.ptr<float>(j)[1]);
             sum_[2] += (y * this->light_intensities.ptr<float>(j)[2]);
         }
-        gray_shading.ptr<float>(i)[0] = face_texture.ptr<float>(i)[0] * (sum_[0] / 5.f);
-        gray_shading.ptr<float>(i)[1] = face_texture.ptr<float>(i)[1] * (sum_[1] / 5.f);
-        gray_shading.ptr<float>(i)[2] = face_texture.ptr<float>(i)[2] * (sum_[2] / 5.f);
-        auto value = gray_shading.ptr<float>(i)[0];
-        gray_shading_max = StdMax(gray_shading_max, value);
+        float* out = gray_shading.ptr<float>(i);
+        out[0] = face_texture * (sum_[0] / 5.f);
+        out[1] = face_texture * (sum_[1] / 5.f);
+        out[2] = face_texture * (sum_[2] / 5.f);
     }
 }
 
+void FaceRender::computeShadingWithSphericalHarmonics(const Face3DMMCoefficients& coefficients, FaceRenderContext& context)
+{
+    FaceParameter& param = context.param;
+
+    // 反照率只与纹理系数有关, 时序模式下同一个人的纹理系数是锁定的, 跨帧复用
+    if (context.albedo_cached == false || 
+        std::memcmp(context.albedo_texture, coefficients.texture, sizeof(context.albedo_texture)) != 0) {
+        Face3DMMCoefficientsMatrix coefficients_mat;
+        formatAsMatrix(coefficients.texture, 1, 80, coefficients_mat.texture);
+        computeTexture(coefficients_mat, param);
+        // RGB --> BGR, 与渲染输出一致
+        const cv::Mat& face_texture = param.face_texture;
+        context.albedo.create(face_texture.rows, 3, CV_32FC1);
+        for (int i = 0; i < face_texture.rows; i++) {
+            const float* src = face_texture.ptr<float>(i);
+            float* dst = context.albedo.ptr<float>(i);
+            dst[0] = src[2];
+            dst[1] = src[1];
+            dst[2] = src[0];
+        }
+        std::memcpy(context.albedo_texture, coefficients.texture, sizeof(context.albedo_texture));
+        context.albedo_cached = true;
+    }
+
+    // 简化网格只取其顶点
+    const FaceVertexSubset& subset = mesh_levels[context.level].subset;
+    const cv::Mat* albedo = &context.albedo;
+    if (subset.indices.empty() == false) {
+        const int n = static_cast<int>(subset.indices.size());
+        context.albedo_level.create(n, 3, CV_32FC1);
+        for (int i = 0; i < n; i++)
+            std::memcpy(context.albedo_level.ptr<float>(i), context.albedo.ptr<float>(subset.indices[i]), 3 * sizeof(float));
+        albedo = &context.albedo_level;
+    }
+
+    // gamma为3x9(RGB), 与训练时一样环境光项加0.8, 按BGR的顺序输出
+    float gamma[27];
+    for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < 9; k++)
+            gamma[c * 9 + k] = coefficients.gamma[(2 - c) * 9 + k] + (k == 0 ? 0.8f : 0.f);
+    }
+    const cv::Mat& normals = param.face_norm_roted;
+    CV_Assert(normals.isContinuous() && normals.rows == albedo->rows);
+    param.gray_shading.create(normals.rows, 3, CV_32FC1);
+    render_sh_shading(normals.ptr<float>(), albedo->ptr<float>(), normals.rows, gamma, param.gray_shading.ptr<float>());
+}
+
 void FaceRender::transformToMatrix(const Face3DMMCoefficients& coefficients, Face3DMMCoefficientsMatrix& matrix)
 {
     formatAsMatrix(coefficients.identity, 1, 80, matrix.identity);
@@ -176,253 +370,470 @@ void FaceRender::transformToMatrix(const Face3DMMCoefficients& coefficients, Fac
     formatAsMatrix(coefficients.translation, 1, 3, matrix.translation);
 }
 
-void FaceRender::calculateParameters(const Face3DMMCoefficients& coefficients, FaceParameter& param, bool with_norm)
+void FaceRender::calculateParameters(const Face3DMMCoefficients& coefficients, FaceParameter& param, bool with_norm, 
+    int level)
 {
+    const FaceMeshLevel& mesh = mesh_levels[level];
     Face3DMMCoefficientsMatrix coefficients_mat;
     transformToMatrix(coefficients, coefficients_mat);
-    computeShape(coefficients_mat, param);
+    computeShape(coefficients_mat, mesh, param);
     computeRotation(coefficients_mat, param);
     transform(coefficients_mat, param);
-    toCamera(coefficients_mat, param);
     // only for shape
     if (with_norm) {
-        computeNorm(coefficients_mat, param);
+        computeNorm(coefficients_mat, mesh, param);
     }
 }
-void FaceRender::renderWithTexture(FaceParameter& param, const cv::Mat& uv_texture, FaceRenderResult& result)
+void FaceRender::calculateSubset(const Face3DMMCoefficients& coefficients, const FaceVertexSubset& subset, FaceParameter& param)
 {
-    cv::Mat& vertex = param.face_vertex;
-    vertex.col(1) = 0.f - vertex.col(1);
-
-    vertex = vertex.isContinuous() ? vertex : vertex.clone();
-    tri = tri.isContinuous() ? tri : tri.clone();
-    bfm_uv = bfm_uv.isContinuous() ? bfm_uv : bfm_uv.clone();
-    
-    // 光栅化
-    cv::Mat rast_out = cv::Mat::zeros(rast_h, rast_w, CV_32FC4); // [h, w, 4]
-    render_rasterize(vertex.ptr<float>(), vertex.rows, tri.ptr<int>(), tri.rows,
-        ndc_proj, rast_h, rast_w, rast_out.ptr<float>());
+    // 与calculateParameters相同的流程, 只是基换成了子集的紧凑基
+    Face3DMMCoefficientsMatrix coefficients_mat;
+    transformToMatrix(coefficients, coefficients_mat);
+    param.face_shape = coefficients_mat.identity * subset.id_base + coefficients_mat.expression * subset.exp_base + subset.mean_shape;
+    param.face_shape = param.face_shape.reshape(0, static_cast<int>(subset.indices.size()));
+    computeRotation(coefficients_mat, param);
+    transform(coefficients_mat, param);
+}
 
-    // 插值UV坐标
-    cv::Mat interp_out = cv::Mat::zeros(rast_h, rast_w, CV_32FC2); // [h, w, 2]
-    render_interpolate(bfm_uv.ptr<float>(), bfm_uv.rows, bfm_uv.cols,
-        rast_out.ptr<float>(), rast_h, rast_w, tri.ptr<int>(), tri.rows, interp_out.ptr<float>());
+void FaceRender::projectSubset(const Face3DMMCoefficients& coefficients, const FaceVertexSubset& subset, cv::Mat& points)
+{
+    FaceParameter param;
+    calculateSubset(coefficients, subset, param);
+
+    // 透视投影到224x224的裁剪图, y轴向下
+    const cv::Mat& vertex = param.face_vertex;
+    const float focal = persc_proj.ptr<float>(0)[0];
+    const float cx = persc_proj.ptr<float>(2)[0];
+    const float cy = persc_proj.ptr<float>(2)[1];
+    points.create(vertex.rows, 2, CV_32F);
+    for (int i = 0; i < vertex.rows; i++) {
+        const float* v = vertex.ptr<float>(i);
+        float* p = points.ptr<float>(i);
+        p[0] = focal * v[0] / v[2] + cx;
+        p[1] = (rast_h - 1) - (focal * v[1] / v[2] + cy);
+    }
+}
 
-    // 纹理采样
-    cv::Mat image_float = cv::Mat::zeros(rast_h, rast_w, CV_32FC4);
-    cv::Mat uv_texture_float;
-    uv_texture.convertTo(uv_texture_float, CV_32F);  // 确保uv_texture是float32类型
-    render_texture(uv_texture_float.ptr<float>(), uv_texture_float.rows, uv_texture_float.cols, 4,
-        interp_out.ptr<float>(), rast_h, rast_w, image_float.ptr<float>());
-    image_float.convertTo(result.image, CV_8U);
+void FaceRender::projectLandmarks(const Face3DMMResult& result_3dmm, const cv::Size& source_size, cv::Mat& points)
+{
+    projectSubset(result_3dmm.coefficients, key_subset, points);
+
+    // 裁剪图 --> 原图, 与cropImage相同的像素中心对齐方式
+    const FormatInfo& format_info = result_3dmm.format_info;
+    const float kx = static_cast<float>(format_info.w) / source_size.width;
+    const float ky = static_cast<float>(format_info.h) / source_size.height;
+    for (int i = 0; i < points.rows; i++) {
+        float* p = points.ptr<float>(i);
+        p[0] = (p[0] + format_info.lft + 0.5f) / kx - 0.5f;
+        p[1] = (p[1] + format_info.top + 0.5f) / ky - 0.5f;
+    }
+}
 
-    // 生成mask
-    cv::Mat alpha_channel;
-    cv::extractChannel(rast_out, alpha_channel, 3);  // BGRA
-    // np.where(rast_out[..., 3] > 0, 1, 0).astype(np.uint8)
-    cv::Mat where_mat;
-    cv::compare(alpha_channel, cv::Scalar(0.0f), where_mat, cv::CMP_GT);
-    where_mat.convertTo(result.mask, CV_8UC1, 255.f, 0.f);
+void FaceRender::projectVertices(FaceRenderContext& context)
+{
+    // 光栅化坐标(y轴向下)与投影一次遍历生成, face_vertex保持相机坐标
+    const float flip[12] = { 1.f, 0.f, 0.f, 0.f, 0.f, -1.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f };
+    const cv::Mat& vertex = context.param.face_vertex;
+    context.vertex_raster.create(vertex.rows, 3, CV_32FC1);
+    context.pos_ndc.resize(vertex.rows * 3);
+    render_transform(vertex.ptr<float>(), vertex.rows, flip, ndc_proj, context.vertex_raster.ptr<float>(), 
+        context.pos_ndc.data());
+}
 
-    // 插值深度
-    cv::Mat vertex_z = vertex.col(2).clone();
-    cv::Mat depth_out = cv::Mat::zeros(rast_h, rast_w, CV_32FC1); // [h, w, 1]
-    render_interpolate(vertex_z.ptr<float>(), vertex_z.rows, vertex_z.cols,
-        rast_out.ptr<float>(), rast_h, rast_w, tri.ptr<int>(), tri.rows, depth_out.ptr<float>());
-    normalizeDepth(depth_out, result);
+void FaceRender::rasterize(FaceRenderContext& context)
+{
+    projectVertices(context);
+    const cv::Mat& vertex = context.vertex_raster;
+    const cv::Mat& tri = mesh_levels[context.level].tri;
+    const int h = context.raster_h;
+    const int w = context.raster_w;
+
+    // 光栅化, 缓冲区复用
+    context.rast_out.create(h, w, CV_32FC4); // [h, w, 4]
+    context.rast_out.setTo(0.f);
+    context.z_buffer.resize(h * w);
+    if (context.reuse_visibility) {
+        render_rasterize_coherent(vertex.ptr<float>(), vertex.rows, tri.ptr<int>(), tri.rows,
+            nullptr, h, w, context.rast_out.ptr<float>(),
+            context.z_buffer.data(), context.pos_ndc.data(), context.raster_cache);
+        return;
+    }
+    render_rasterize(vertex.ptr<float>(), vertex.rows, tri.ptr<int>(), tri.rows,
+        nullptr, h, w, context.rast_out.ptr<float>(), 
+        context.z_buffer.data(), context.pos_ndc.data());
 }
 
-void FaceRender::renderShape(FaceParameter& param, FaceRenderResult& result)
+void FaceRender::rasterizeTiles(FaceRenderContext& context, const std::function<void(int, int, int, int)>& shade)
 {
-    computeGrayShadingWithDirectionLight(param);
+    const int h = context.raster_h;
+    const int w = context.raster_w;
+    if (h <= raster_tile && w <= raster_tile) {
+        rasterize(context);
+        shade(0, 0, h, w);
+        return;
+    }
 
-    cv::Mat& vertex = param.face_vertex;
-    vertex.col(1) = 0.f - vertex.col(1);
+    // 大尺寸分块: 三角形只建立一次, 每块只需要块大小的光栅缓冲
+    projectVertices(context);
+    const cv::Mat& vertex = context.vertex_raster;
+    const cv::Mat& tri = mesh_levels[context.level].tri;
+    context.triangles.resize(tri.rows);
+    render_setup(vertex.ptr<float>(), vertex.rows, tri.ptr<int>(), tri.rows, nullptr, h, w, 
+        context.pos_ndc.data(), context.triangles.data());
+
+    context.rast_out.create(raster_tile, raster_tile, CV_32FC4);
+    context.z_buffer.resize(raster_tile * raster_tile);
+    for (int y0 = 0; y0 < h; y0 += raster_tile) {
+        for (int x0 = 0; x0 < w; x0 += raster_tile) {
+            const int tile_h = StdMin(raster_tile, h - y0);
+            const int tile_w = StdMin(raster_tile, w - x0);
+            float* rast = context.rast_out.ptr<float>();
+            std::fill(rast, rast + tile_h * tile_w * 4, 0.f);
+            render_rasterize_tile(context.triangles.data(), tri.rows, h, w, y0, x0, tile_h, tile_w, 
+                rast, context.z_buffer.data());
+            shade(y0, x0, tile_h, tile_w);
+        }
+    }
+}
 
-    vertex = vertex.isContinuous() ? vertex : vertex.clone();
-    tri = tri.isContinuous() ? tri : tri.clone();
+void FaceRender::interpolateDepth(FaceRenderContext& context, FaceRenderResult& result)
+{
+    // mask与插值深度一次遍历生成, 同时得到深度范围
+    const cv::Mat& tri = mesh_levels[context.level].tri;
+    const cv::Mat& vertex = context.param.face_vertex;
+    const int h = context.raster_h;
+    const int w = context.raster_w;
+    vertex.col(2).copyTo(context.vertex_z);
+    context.depth_out.create(h, w, CV_32FC1); // [h, w, 1]
+    result.mask.create(h, w, CV_8UC1);
+    float range[2] = { FLT_MAX, -FLT_MAX };
+    render_deferred_depth(context.rast_out.ptr<float>(), h, w, tri.ptr<int>(), tri.rows,
+        context.vertex_z.ptr<float>(), context.vertex_z.rows, result.mask.ptr<uchar>(), 
+        context.depth_out.ptr<float>(), range);
+    normalizeDepth(context.depth_out, range, result);
+}
 
-    // 光栅化
-    cv::Mat rast_out = cv::Mat::zeros(rast_h, rast_w, CV_32FC4); // [h, w, 4]
-    render_rasterize(vertex.ptr<float>(), vertex.rows, tri.ptr<int>(), tri.rows,
-        ndc_proj, rast_h, rast_w, rast_out.ptr<float>());
+const FaceTexture& FaceRender::cacheTexture(const cv::Mat& uv_texture, int layouts, FaceRenderContext& context)
+{
+    // 同一张纹理只预处理一次, 持有源图的引用以保证其数据不被释放和复用
+    cv::Mat image = uv_texture;
+    const cv::Mat& source = context.texture_source;
+    bool cached = source.data == image.data && source.size() == image.size() && 
+        source.type() == image.type() && source.step == image.step;
+    if (cached == false) {
+        context.texture.release();
+        context.texture_source = image;
+    }
+    context.texture.create(image, layouts);
+    return context.texture;
+}
 
-    // 插值
-    cv::Mat shape = cv::Mat::zeros(rast_h, rast_w, CV_32FC3); // [h, w, 2]
-    render_interpolate(param.gray_shading.ptr<float>(), param.gray_shading.rows, param.gray_shading.cols,
-        rast_out.ptr<float>(), rast_h, rast_w, tri.ptr<int>(), tri.rows, shape.ptr<float>());
-    shape.convertTo(result.image, CV_8UC3, 255.f, 0.f);
+void FaceRender::setDeferredShading(bool enable)
+{
+    deferred_shading = enable;
+}
 
-    // 生成mask
-    cv::Mat alpha_channel;
-    cv::extractChannel(rast_out, alpha_channel, 3);  // BGRA
-    // np.where(rast_out[..., 3] > 0, 1, 0).astype(np.uint8)
-    cv::Mat where_mat;
-    cv::compare(alpha_channel, cv::Scalar(0.0f), where_mat, cv::CMP_GT);
-    where_mat.convertTo(result.mask, CV_8UC1, 255.f, 0.f);
+void FaceRender::setRasterSize(int minimum, int maximum, int tile)
+{
+    raster_minimum = StdMax(minimum, 1);
+    raster_maximum = StdMax(maximum, raster_minimum);
+    raster_tile = StdMax(tile, 16);
+}
 
-    // 插值深度
-    cv::Mat vertex_z = vertex.col(2).clone();
-    cv::Mat depth_out = cv::Mat::zeros(rast_h, rast_w, CV_32FC1); // [h, w, 1]
-    render_interpolate(vertex_z.ptr<float>(), vertex_z.rows, vertex_z.cols,
-        rast_out.ptr<float>(), rast_h, rast_w, tri.ptr<int>(), tri.rows, depth_out.ptr<float>());
-    normalizeDepth(depth_out, result);
+cv::Size FaceRender::selectRasterSize(const Face3DMMResult& result_3dmm) const
+{
+    // 固定尺寸
+    const FormatInfo& format_info = result_3dmm.format_info;
+    if (raster_minimum == raster_maximum || format_info.src_h <= 0 || format_info.src_w <= 0) {
+        return cv::Size(raster_maximum, raster_maximum);
+    }
+
+    // 裁剪窗口在原图中的尺寸, 与calculatePasteRegion一致; 按它渲染时贴回不需要缩放
+    const float rh = static_cast<float>(format_info.h) / format_info.src_h;
+    const float rw = static_cast<float>(format_info.w) / format_info.src_w;
+    const int nh = static_cast<int>(std::round(rast_h / rh));
+    const int nw = static_cast<int>(std::round(rast_w / rw));
+    const int size = StdMax(nh, nw);
+    if (raster_minimum <= size && size <= raster_maximum) {
+        return cv::Size(nw, nh);
+    }
+    const int clamped = StdMin(StdMax(size, raster_minimum), raster_maximum);
+    return cv::Size(clamped, clamped);
 }
 
-void FaceRender::normalizeDepth(const cv::Mat& depth, FaceRenderResult& result)
+void FaceRender::renderWithTexture(FaceRenderContext& context, const FaceTexture& texture, FaceRenderResult& result)
 {
-    const cv::Mat& mask = result.mask;
+    // 纹理缺少当前路径需要的版本时(如注册表只准备了mipmap), 在上下文中生成并缓存
+    const int layout = deferred_shading ? FaceTextureMip : FaceTextureFloat;
+    if (texture.has(layout) == false) {
+        renderWithTexture(context, cacheTexture(texture.source, layout, context), result);
+        return;
+    }
 
-    int rows = depth.rows;
-    int cols = depth.cols;
+    const cv::Mat& tri = mesh_levels[context.level].tri;
+    const cv::Mat& tri_uv = mesh_levels[context.level].tri_uv;
+    const int h = context.raster_h;
+    const int w = context.raster_w;
+
+    // 8位纹理直接采样, 不再经过float纹理和中间的uv/图像缓冲
+    // 按三角形在屏幕上的大小选择mipmap层级, 定点双线性插值
+    if (deferred_shading) {
+        const cv::Mat& vertex = context.param.face_vertex;
+        vertex.col(2).copyTo(context.vertex_z);
+        context.depth_out.create(h, w, CV_32FC1);
+        result.image.create(h, w, CV_8UC4);
+        result.mask.create(h, w, CV_8UC1);
+        result.depth.create(h, w, CV_8UC1);
+        float range[2] = { FLT_MAX, -FLT_MAX };
+        rasterizeTiles(context, [&](int y0, int x0, int tile_h, int tile_w) {
+            const int offset = y0 * w + x0;
+            render_deferred_texture_tile(context.rast_out.ptr<float>(), tile_h, tile_w, tri.ptr<int>(), tri.rows,
+                context.vertex_z.ptr<float>(), tri_uv.ptr<float>(), context.vertex_z.rows,
+                texture.texture_mip, context.pos_ndc.data(), h, w,
+                w, result.image.ptr<uchar>() + offset * 4, result.mask.ptr<uchar>() + offset, 
+                context.depth_out.ptr<float>() + offset, range);
+        });
+        render_resolve_depth(context.depth_out.ptr<float>(), result.mask.ptr<uchar>(), h, w, range, result.depth.ptr<uchar>());
+        return;
+    }
+    rasterize(context);
 
-    // 第一次遍历：找非零区域的 min 和 max
-    float d_min = FLT_MAX;
-    float d_max = -FLT_MAX;
-    bool found = false;
+    // 插值UV坐标
+    context.interp_out.create(h, w, CV_32FC2); // [h, w, 2]
+    context.interp_out.setTo(0.f);
+    render_interpolate_table(tri_uv.ptr<float>(), 2, context.rast_out.ptr<float>(), h, w, tri.rows,
+        context.interp_out.ptr<float>());
 
-    const float* d_data = depth.ptr<float>(0);
-    const uchar* m_data = mask.ptr<uchar>(0);
+    // 纹理采样
+    const cv::Mat& uv_texture_float = texture.texture_float;
+    context.image_float.create(h, w, CV_32FC4);
+    context.image_float.setTo(0.f);
+    render_texture(uv_texture_float.ptr<float>(), uv_texture_float.rows, uv_texture_float.cols, 4,
+        context.interp_out.ptr<float>(), h, w, context.image_float.ptr<float>());
+    context.image_float.convertTo(result.image, CV_8U);
 
-    for (int i = 0; i < rows * cols; ++i) {
-        if (m_data[i] > 0 && d_data[i] > 0) {
-            if (d_data[i] < d_min) d_min = d_data[i];
-            if (d_data[i] > d_max) d_max = d_data[i];
-            found = true;
-        }
-    }
+    // mask与深度
+    interpolateDepth(context, result);
+}
 
-    // 如果没有有效点
-    if (!found || d_max <= d_min) {
-        result.depth = cv::Mat::zeros(rows, cols, CV_8UC1);
+void FaceRender::renderShape(FaceRenderContext& context, FaceRenderResult& result)
+{
+    FaceParameter& param = context.param;
+    const cv::Mat& tri = mesh_levels[context.level].tri;
+    const int h = context.raster_h;
+    const int w = context.raster_w;
+
+    if (deferred_shading) {
+        const cv::Mat& vertex = param.face_vertex;
+        vertex.col(2).copyTo(context.vertex_z);
+        context.depth_out.create(h, w, CV_32FC1);
+        result.image.create(h, w, CV_8UC3);
+        result.mask.create(h, w, CV_8UC1);
+        result.depth.create(h, w, CV_8UC1);
+        float range[2] = { FLT_MAX, -FLT_MAX };
+        rasterizeTiles(context, [&](int y0, int x0, int tile_h, int tile_w) {
+            const int offset = y0 * w + x0;
+            render_deferred_shape_tile(context.rast_out.ptr<float>(), tile_h, tile_w, tri.ptr<int>(), tri.rows,
+                context.vertex_z.ptr<float>(), param.gray_shading.ptr<float>(), param.gray_shading.rows,
+                w, result.image.ptr<uchar>() + offset * 3, result.mask.ptr<uchar>() + offset, 
+                context.depth_out.ptr<float>() + offset, range);
+        });
+        render_resolve_depth(context.depth_out.ptr<float>(), result.mask.ptr<uchar>(), h, w, range, result.depth.ptr<uchar>());
         return;
     }
+    rasterize(context);
 
-    float range = d_max - d_min;
-
-    // 第二次遍历：归一化 + 裁剪 + mask 处理
-    result.depth = cv::Mat::zeros(rows, cols, CV_8UC1);
-    cv::Mat& result_depth = result.depth;
-    for (int i = 0; i < result_depth.rows; ++i) {
-        for (int j = 0; j < result_depth.cols; ++j) {
-            if (mask.ptr<uchar>(i, j)[0] > 0) {
-                float val = (depth.ptr<float>(i, j)[0] - d_min) / range * 255.0f;
-                val = StdMax(val, 0.f);
-                val = StdMin(val, 255.f);
-                val = 255.0f - val;
-                result_depth.at<uchar>(i, j) = static_cast<uchar>(val);
-            }
-            else {
-                result_depth.at<uchar>(i, j) = 0;
-            }
-        }
-    }
+    // 插值
+    context.shape_float.create(h, w, CV_32FC3); // [h, w, 3]
+    context.shape_float.setTo(0.f);
+    render_interpolate(param.gray_shading.ptr<float>(), param.gray_shading.rows, param.gray_shading.cols,
+        context.rast_out.ptr<float>(), h, w, tri.ptr<int>(), tri.rows, context.shape_float.ptr<float>());
+    context.shape_float.convertTo(result.image, CV_8UC3, 255.f, 0.f);
+
+    // mask与深度
+    interpolateDepth(context, result);
+}
+
+void FaceRender::normalizeDepth(const cv::Mat& depth, const float* range, FaceRenderResult& result)
+{
+    // 非零区域的深度范围由生成深度的那次遍历顺带给出
+    CV_Assert(depth.isContinuous() && result.mask.isContinuous());
+
+    // 归一化 + 裁剪 + 反转 + mask 处理, 没有有效点时全为0
+    result.depth.create(depth.rows, depth.cols, CV_8UC1);
+    render_resolve_depth(depth.ptr<float>(), result.mask.ptr<uchar>(), depth.rows, depth.cols, range,
+        result.depth.ptr<uchar>());
 }
 
 void FaceRender::inference(const Face3DMMResult& result_3dmm, const cv::Mat& uv_texture, FaceRenderResult& result_render)
 {
-    FaceParameter face_param;
-    calculateParameters(result_3dmm.coefficients, face_param, false);
-    renderWithTexture(face_param, uv_texture, result_render);
+    FaceRenderContext context;
+    inference(result_3dmm, uv_texture, result_render, context);
 }
 
 void FaceRender::inference(const Face3DMMResult& result_3dmm, FaceRenderResult& result_render)
 {
-    FaceParameter face_param;
-    calculateParameters(result_3dmm.coefficients, face_param, true);
-    renderShape(face_param, result_render);
+    FaceRenderContext context;
+    inference(result_3dmm, result_render, context);
+}
+
+void FaceRender::inference(const Face3DMMResult& result_3dmm, const cv::Mat& uv_texture, FaceRenderResult& result_render,
+    FaceRenderContext& context)
+{
+    const FaceTexture& texture = cacheTexture(uv_texture, deferred_shading ? FaceTextureMip : FaceTextureFloat, context);
+    inference(result_3dmm, texture, result_render, context);
 }
 
-void FaceRender::pasteBack(const Face3DMMResult& result_3dmm, const FaceRenderResult& result_render, const cv::Mat& source, FaceRenderResult& result_source)
+void FaceRender::inference(const Face3DMMResult& result_3dmm, const FaceTexture& texture, FaceRenderResult& result_render,
+    FaceRenderContext& context)
 {
-    // 解包 box 值
-    auto& format_info = result_3dmm.format_info;
-    int hh = format_info.h, ww = format_info.w;
-    int lft = format_info.lft, top = format_info.top, rig = format_info.rig, bot = format_info.bot;
+    const cv::Size raster_size = selectRasterSize(result_3dmm);
+    context.raster_h = raster_size.height;
+    context.raster_w = raster_size.width;
+    context.level = selectLevel(result_3dmm);
+    calculateParameters(result_3dmm.coefficients, context.param, false, context.level);
+    renderWithTexture(context, texture, result_render);
+}
 
-    // 获取 bgr 的尺寸
-    int h = source.rows;
-    int w = source.cols;
-    int c = source.channels();
+void FaceRender::inference(const Face3DMMResult& result_3dmm, FaceRenderResult& result_render, FaceRenderContext& context)
+{
+    const cv::Size raster_size = selectRasterSize(result_3dmm);
+    context.raster_h = raster_size.height;
+    context.raster_w = raster_size.width;
+    context.level = selectLevel(result_3dmm);
+    calculateParameters(result_3dmm.coefficients, context.param, true, context.level);
+    if (harmonic_shading)
+        computeShadingWithSphericalHarmonics(result_3dmm.coefficients, context);
+    else
+        computeGrayShadingWithDirectionLight(context.param);
+    renderShape(context, result_render);
+}
 
-    // 计算缩放比例
-    float rh = static_cast<float>(hh) / h;
-    float rw = static_cast<float>(ww) / w;
+// 变换到人脸区域, 缩放为1且平移为整数(按人脸在原图中的尺寸渲染)时直接拷贝
+static void warpToRegion(const cv::Mat& src, cv::Mat& dst, const cv::Mat& warp_matrix, const cv::Size& size, 
+    int interpolation)
+{
+    const double* m0 = warp_matrix.ptr<double>(0);
+    const double* m1 = warp_matrix.ptr<double>(1);
+    if (m0[0] == 1. && m0[1] == 0. && m1[0] == 0. && m1[1] == 1. && 
+        m0[2] == std::floor(m0[2]) && m1[2] == std::floor(m1[2])) {
+        dst = cv::Mat::zeros(size, src.type());
+        cv::Rect target(static_cast<int>(m0[2]), static_cast<int>(m1[2]), src.cols, src.rows);
+        cv::Rect overlap = target & cv::Rect(0, 0, size.width, size.height);
+        if (overlap.area() > 0) {
+            src(overlap - target.tl()).copyTo(dst(overlap));
+        }
+        return;
+    }
+    cv::warpAffine(src, dst, warp_matrix, size, interpolation, cv::BORDER_CONSTANT, cv::Scalar::all(0));
+}
 
-    // 计算新的尺寸
+cv::Rect FaceRender::calculatePasteRegion(const FormatInfo& format_info, const cv::Size& face_size, 
+    const cv::Size& source_size, int margin, cv::Mat& warp_matrix)
+{
+    // 缩放比例: 裁剪图(w0 * s, h0 * s) --> 原图
+    float rh = static_cast<float>(format_info.h) / source_size.height;
+    float rw = static_cast<float>(format_info.w) / source_size.width;
+
+    // 裁剪窗口在原图中的尺寸与位置, 渲染结果可以是任意分辨率
+    int nh = static_cast<int>(std::round(rast_h / rh));
+    int nw = static_cast<int>(std::round(rast_w / rw));
+    int lp = std::max(static_cast<int>(std::round(format_info.lft / rw)), 0);
+    int tp = std::max(static_cast<int>(std::round(format_info.top / rh)), 0);
+
+    // 人脸区域(外扩margin供模糊使用), 裁剪到原图内
+    cv::Rect region(lp - margin, tp - margin, nw + 2 * margin, nh + 2 * margin);
+    region &= cv::Rect(0, 0, source_size.width, source_size.height);
+
+    // 与cv::resize相同的像素中心对齐方式, 平移到region的局部坐标
+    double kx = static_cast<double>(nw) / face_size.width;
+    double ky = static_cast<double>(nh) / face_size.height;
+    warp_matrix = (cv::Mat_<double>(2, 3) <<
+        kx, 0., lp - region.x + 0.5 * kx - 0.5,
+        0., ky, tp - region.y + 0.5 * ky - 0.5);
+    return region;
+}
+
+cv::Rect FaceRender::pasteBackRegion(const Face3DMMResult& result_3dmm, const FaceRenderResult& result_render,
+    const cv::Size& source_size, cv::Mat* image, int outputs, FaceRenderResult& result_region)
+{
     const cv::Mat& face = result_render.image;
-    int nh = static_cast<int>(std::round(face.rows / rh));
-    int nw = static_cast<int>(std::round(face.cols / rw));
-
-    // 计算填充参数
-    int lp = std::max(static_cast<int>(std::round(lft / rw)), 0);
-    int rp_src = w - nw - lp;
-    int rp = std::max(rp_src, 0);
-    int tp = std::max(static_cast<int>(std::round(top / rh)), 0);
-    int bp_src = h - nh - tp;
-    int bp = std::max(bp_src, 0);
-
-    cv::Mat face_new, face_padded;
-    cv::resize(face, face_new, cv::Size(nw, nh), 0, 0, cv::INTER_CUBIC);
-    cv::copyMakeBorder(face_new, face_padded, tp, bp, lp, rp, cv::BORDER_CONSTANT, cv::Scalar::all(0));
-
-    if (result_render.mask.empty() == false) {
+    const int k = 7;  // alpha的高斯模糊核
+    cv::Mat warp_matrix;
+    cv::Rect region = calculatePasteRegion(result_3dmm.format_info, face.size(), source_size, k / 2 + 1, warp_matrix);
+    if (region.area() == 0) {
+        return region;
+    }
+
+    // 3通道图像使用mask作为alpha, 因此融合时也需要mask
+    const bool need_image = image != nullptr && (outputs & PasteBackImage);
+    const bool need_mask = (outputs & PasteBackMask) || (need_image && face.channels() == 3);
+    if (need_mask && result_render.mask.empty() == false) {
         cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3, 3));
-        cv::Mat mask_eroded, mask_resized, mask_padded;
+        cv::Mat mask_eroded;
         cv::erode(result_render.mask, mask_eroded, kernel);
-        cv::resize(mask_eroded, mask_resized, cv::Size(nw, nh), 0, 0, cv::INTER_LINEAR);
-        cv::copyMakeBorder(mask_resized, mask_padded, tp, bp, lp, rp, cv::BORDER_CONSTANT, cv::Scalar::all(0));
-        if (rp_src < 0) {
-            mask_padded = mask_padded(cv::Range::all(), cv::Range(0, mask_padded.cols + rp_src)).clone();
-        }
-        if (bp_src < 0) {
-            mask_padded = mask_padded(cv::Range(0, mask_padded.rows + bp_src), cv::Range::all()).clone();
-        }
-        result_source.mask = mask_padded.clone();
-    }
-    
-    if (result_render.depth.empty() == false) {
-        cv::Mat depth_resized, depth_padded;
-        cv::resize(result_render.depth, depth_resized, cv::Size(nw, nh), 0, 0, cv::INTER_LINEAR);
-        cv::copyMakeBorder(depth_resized, depth_padded, tp, bp, lp, rp, cv::BORDER_CONSTANT, cv::Scalar::all(0));
-        if (rp_src < 0) {
-            depth_padded = depth_padded(cv::Range::all(), cv::Range(0, depth_padded.cols + rp_src)).clone();
-        }
-        if (bp_src < 0) {
-            depth_padded = depth_padded(cv::Range(0, depth_padded.rows + bp_src), cv::Range::all()).clone();
-        }
-        result_source.depth = depth_padded.clone();
+        warpToRegion(mask_eroded, result_region.mask, warp_matrix, region.size(), cv::INTER_LINEAR);
     }
 
-    // 处理负的填充情况（裁剪）
-    if (rp_src < 0) {
-        face_padded = face_padded(cv::Range::all(), cv::Range(0, face_padded.cols + rp_src));
-    }
-    if (bp_src < 0) {
-        face_padded = face_padded(cv::Range(0, face_padded.rows + bp_src), cv::Range::all());
+    if ((outputs & PasteBackDepth) && result_render.depth.empty() == false) {
+        warpToRegion(result_render.depth, result_region.depth, warp_matrix, region.size(), cv::INTER_LINEAR);
     }
 
-    // 创建结果图像
-    cv::Mat composite = cv::Mat::zeros(source.size(), CV_32FC3);
+    if (need_image == false) {
+        return region;
+    }
 
-    if (face_padded.channels() == 4) {
-        // 通道分离
-        cv::Mat face_bgr, face_alpha;
-        splitImage(face_padded, face_bgr, face_alpha);
-        // 将非255的alpha值设为0
-        cv::Mat mask_alpha;
+    // 只把渲染结果变换到人脸区域, 然后在原图的ROI上原地融合
+    cv::Mat face_region, canvas = (*image)(region);
+    warpToRegion(face, face_region, warp_matrix, region.size(), cv::INTER_CUBIC);
+    if (face_region.channels() == 4) {
+        // 通道分离, 只保留alpha为255的区域并做高斯模糊
+        cv::Mat face_bgr, face_alpha, mask_alpha, alpha_blurred;
+        splitImage(face_region, face_bgr, face_alpha);
         cv::compare(face_alpha, 255, mask_alpha, cv::CMP_EQ);
-        face_alpha.setTo(0, ~mask_alpha);
-        // 高斯模糊
-        const int k = 7;
-        cv::Mat alpha_blurred;
         cv::GaussianBlur(mask_alpha, alpha_blurred, cv::Size(k, k), k / 2.0, k / 2.0);
-        fuseImage(face_bgr, source, alpha_blurred, result_source.image);
+        blendImageInplace(face_bgr, alpha_blurred, canvas);
     }
-    else if (face_padded.channels() == 3) {
-        fuseImage(face_padded, source, result_source.mask, result_source.image);
+    else if (face_region.channels() == 3) {
+        if (result_region.mask.empty()) {
+            throw std::runtime_error("Mask is required for 3-channel face image.");
+        }
+        blendImageInplace(face_region, result_region.mask, canvas);
     }
     else {
         throw std::runtime_error("Unsupported number of channels in face image.");
     }
-}
\ No newline at end of file
+    return region;
+}
+
+cv::Rect FaceRender::pasteBackInplace(const Face3DMMResult& result_3dmm, const FaceRenderResult& result_render, cv::Mat& image)
+{
+    FaceRenderResult result_region;
+    return pasteBackRegion(result_3dmm, result_render, image.size(), &image, PasteBackImage, result_region);
+}
+
+void FaceRender::pasteBack(const Face3DMMResult& result_3dmm, const FaceRenderResult& result_render, const cv::Mat& source, 
+    FaceRenderResult& result_source, int outputs)
+{
+    if (outputs & PasteBackImage) {
+        source.copyTo(result_source.image);
+    }
+
+    FaceRenderResult result_region;
+    cv::Rect region = pasteBackRegion(result_3dmm, result_render, source.size(), 
+        &result_source.image, outputs, result_region);
+
+    // 按需生成全分辨率的mask与depth
+    if (outputs & PasteBackMask) {
+        result_source.mask = cv::Mat::zeros(source.size(), CV_8UC1);
+        if (result_region.mask.empty() == false) {
+            result_region.mask.copyTo(result_source.mask(region));
+        }
+    }
+    if (outputs & PasteBackDepth) {
+        result_source.depth = cv::Mat::zeros(source.size(), CV_8UC1);
+        if (result_region.depth.empty() == false) {
+            result_region.depth.copyTo(result_source.depth(region));
+        }
+    }
+}
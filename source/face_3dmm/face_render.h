@@ -2,9 +2,14 @@
 #ifndef __Face_Render__
 #define __Face_Render__
 
+#include <functional>
 #include "singleton.h"
 #include "tools/ximage.h"
 #include "face_3dmm.h"
+#include "mesh_render.h"
+#include "face_texture.h"
+
+class XArrayContainer;
 
 
 struct Face3DMMCoefficientsMatrix
@@ -24,7 +29,33 @@ struct FaceParameter
     cv::Mat face_vertex;      // 35709,3
     cv::Mat face_texture;     // 1,107127 --> 35709,3
     cv::Mat face_norm_roted;  // 35709,3
-    cv::Mat gray_shading;     // 35709,3
+    cv::Mat gray_shading;     // 35709,3  顶点着色(BGR)
+    // 中间结果, 跨帧复用
+    cv::Mat shape_flat;       // 1,107127
+    cv::Mat shape_expression; // 1,107127
+    cv::Mat tri_norm;         // 70790,3
+    cv::Mat vertex_norm;      // 35709,3
+};
+
+// 顶点子集(如68个关键点)的紧凑基, 从完整的bfm中按行预先收集
+struct FaceVertexSubset
+{
+    std::vector<int> indices;  // n
+    cv::Mat mean_shape;        // 1,n*3
+    cv::Mat id_base;           // 80,n*3
+    cv::Mat exp_base;          // 64,n*3
+};
+
+// 网格细节层级: 简化网格的顶点是完整网格的子集, 各自的拓扑/uv/基都预先准备好
+// 第0层是完整网格(与FaceRender的成员共享数据), 人脸在原图中不超过max_face_size时才能用该层
+struct FaceMeshLevel
+{
+    float max_face_size = 0.f;
+    FaceVertexSubset subset;   // 完整网格时indices为空
+    cv::Mat tri;               // m,3
+    cv::Mat point_buf;         // n,8  用m补齐
+    cv::Mat bfm_uv;            // n,2
+    cv::Mat tri_uv;            // m,6
 };
 
 struct FaceRenderResult 
@@ -34,6 +65,54 @@ struct FaceRenderResult
     cv::Mat depth;  // 深度图
 };
 
+// 渲染上下文: 持有每帧都要用到的缓冲区, 跨帧复用以避免反复分配
+// 直接传入的uv纹理按源图预处理并缓存, 原地修改了纹理内容时需要调用invalidateTexture
+struct FaceRenderContext
+{
+    FaceParameter param;
+    int level = 0;          // 本帧使用的网格层级
+    cv::Mat rast_out;       // h,w,4
+    cv::Mat interp_out;     // h,w,2
+    cv::Mat image_float;    // h,w,4
+    cv::Mat shape_float;    // h,w,3
+    cv::Mat vertex_z;       // 35709,1
+    cv::Mat depth_out;      // h,w
+    cv::Mat vertex_raster;  // 35709,3  光栅化坐标, y轴向下
+    std::vector<float> z_buffer;
+    std::vector<float> pos_ndc;
+    // 本帧的光栅尺寸, 分块渲染时rast_out/z_buffer只有一块大小
+    int raster_h = 224;
+    int raster_w = 224;
+    std::vector<RenderTriangle> triangles;
+    // 可见性缓存: 先画上一帧可见的三角形, 其余的用分块深度剔除
+    // 结果与逐帧完整光栅化一致, 自遮挡多或光栅较大时收益明显, 一个上下文只用于同一张人脸
+    bool reuse_visibility = false;
+    RenderRasterCache raster_cache;
+    // 反照率(BGR)按纹理系数缓存, 同一个人的纹理系数不变时只计算一次
+    float albedo_texture[80];
+    bool albedo_cached = false;
+    cv::Mat albedo;         // 35709,3
+    cv::Mat albedo_level;   // 简化网格的顶点
+    // uv纹理缓存
+    cv::Mat texture_source;
+    FaceTexture texture;
+
+    void invalidateTexture()
+    {
+        texture_source.release();
+        texture.release();
+    }
+};
+
+// pasteBack的输出选项, mask/depth只有在需要时才生成全分辨率结果
+enum PasteBackOutput
+{
+    PasteBackImage = 0x1,
+    PasteBackMask = 0x2,
+    PasteBackDepth = 0x4,
+    PasteBackAll = PasteBackImage | PasteBackMask | PasteBackDepth,
+};
+
 
 class FaceRender
 {
@@ -59,34 +138,80 @@ public:
     cv::Mat key_points;
     // uv
     cv::Mat bfm_uv;  // 35709, 2
+    cv::Mat tri_uv;  // 70790, 6  按三角形预先收集的uv
+    // key points subset
+    FaceVertexSubset key_subset;
+    // 网格细节层级, 按细节递减排列
+    std::vector<FaceMeshLevel> mesh_levels;
+    bool adaptive_level = true;
 public:
     const float fov = 12.593637f;
+    // 裁剪图(模型空间)的尺寸, 实际渲染的光栅尺寸由raster_*决定
     const int rast_h = 224;
     const int rast_w = 224;
     const float camera_distance = 10.f;
     const float ndc_proj[16] = { 9.06250f, 0.f, 0.f, 0.f, 0.f, 9.06250f, 0.f, 0.f, 0.f, 0.f, 2.f, 1.f, 0.f, 0.f, -15.f, 0.f };
+    // 延迟着色: 光栅化后一次遍历直接输出8位的图像/mask/深度
+    bool deferred_shading = true;
+    // 光栅尺寸: 裁剪窗口在原图中的尺寸限制在[minimum, maximum]内, 相等时为固定尺寸
+    // 超过tile的光栅分块渲染(仅延迟着色), ndc_proj与分辨率无关
+    int raster_minimum = 224;
+    int raster_maximum = 224;
+    int raster_tile = 512;
+    // 球谐光照: 用系数中的gamma和纹理系数重建的反照率着色, 关闭时为固定方向光的灰度着色
+    bool harmonic_shading = false;
 
 public:
     void initialize(const char* path_bfm);
+    void setDeferredShading(bool enable);
+    void setAdaptiveLevel(bool enable);
+    void setHarmonicShading(bool enable);
+    void setRasterSize(int minimum, int maximum, int tile = 512);
+    cv::Size selectRasterSize(const Face3DMMResult& result_3dmm) const;
+    int selectLevel(const Face3DMMResult& result_3dmm) const;
     void inference(const Face3DMMResult& result_3dmm, const cv::Mat& uv_texture, FaceRenderResult& result_render);
     void inference(const Face3DMMResult& result_3dmm, FaceRenderResult& result_render);
-    void pasteBack(const Face3DMMResult& result_3dmm, const FaceRenderResult& result_render, const cv::Mat& source, FaceRenderResult& result_source);
+    void inference(const Face3DMMResult& result_3dmm, const cv::Mat& uv_texture, FaceRenderResult& result_render, 
+        FaceRenderContext& context);
+    void inference(const Face3DMMResult& result_3dmm, FaceRenderResult& result_render, FaceRenderContext& context);
+    void inference(const Face3DMMResult& result_3dmm, const FaceTexture& texture, FaceRenderResult& result_render,
+        FaceRenderContext& context);
+    void pasteBack(const Face3DMMResult& result_3dmm, const FaceRenderResult& result_render, const cv::Mat& source, 
+        FaceRenderResult& result_source, int outputs = PasteBackAll);
+    cv::Rect pasteBackInplace(const Face3DMMResult& result_3dmm, const FaceRenderResult& result_render, cv::Mat& image);
+public:
+    void gatherSubset(const std::vector<int>& indices, FaceVertexSubset& subset) const;
+    void calculateSubset(const Face3DMMCoefficients& coefficients, const FaceVertexSubset& subset, FaceParameter& param);
+    void projectSubset(const Face3DMMCoefficients& coefficients, const FaceVertexSubset& subset, cv::Mat& points);
+    void projectLandmarks(const Face3DMMResult& result_3dmm, const cv::Size& source_size, cv::Mat& points);
 protected:
-    void calculateParameters(const Face3DMMCoefficients& coefficients, FaceParameter& param, bool with_norm = false);
+    void loadLevels(const XArrayContainer& container);
+    void calculateParameters(const Face3DMMCoefficients& coefficients, FaceParameter& param, bool with_norm = false, 
+        int level = 0);
     void transformToMatrix(const Face3DMMCoefficients& coefficients, Face3DMMCoefficientsMatrix& matrix);
-    void computeShape(Face3DMMCoefficientsMatrix& coefficients, FaceParameter& param);
+    void computeShape(Face3DMMCoefficientsMatrix& coefficients, const FaceMeshLevel& mesh, FaceParameter& param);
     void computeRotation(Face3DMMCoefficientsMatrix& coefficients, FaceParameter& param);
     void transform(Face3DMMCoefficientsMatrix& coefficients, FaceParameter& param);
-    void toCamera(Face3DMMCoefficientsMatrix& coefficients, FaceParameter& param);
     void computeTexture(Face3DMMCoefficientsMatrix& coefficients, FaceParameter& param);
-    void computeNorm(Face3DMMCoefficientsMatrix& coefficients, FaceParameter& param);
+    void computeNorm(Face3DMMCoefficientsMatrix& coefficients, const FaceMeshLevel& mesh, FaceParameter& param);
+protected:
+    cv::Rect calculatePasteRegion(const FormatInfo& format_info, const cv::Size& face_size, 
+        const cv::Size& source_size, int margin, cv::Mat& warp_matrix);
+    cv::Rect pasteBackRegion(const Face3DMMResult& result_3dmm, const FaceRenderResult& result_render,
+        const cv::Size& source_size, cv::Mat* image, int outputs, FaceRenderResult& result_region);
 protected:
-    void normalizeDepth(const cv::Mat& depth, FaceRenderResult& result);
+    void normalizeDepth(const cv::Mat& depth, const float* range, FaceRenderResult& result);
+    void projectVertices(FaceRenderContext& context);
+    void rasterize(FaceRenderContext& context);
+    void rasterizeTiles(FaceRenderContext& context, const std::function<void(int, int, int, int)>& shade);
+    void interpolateDepth(FaceRenderContext& context, FaceRenderResult& result);
+    const FaceTexture& cacheTexture(const cv::Mat& uv_texture, int layouts, FaceRenderContext& context);
 protected:
-    void renderWithTexture(FaceParameter& param, const cv::Mat& uv_texture, FaceRenderResult& result);
+    void renderWithTexture(FaceRenderContext& context, const FaceTexture& texture, FaceRenderResult& result);
 protected:
-    void renderShape(FaceParameter& param, FaceRenderResult& result);
+    void renderShape(FaceRenderContext& context, FaceRenderResult& result);
     void computeGrayShadingWithDirectionLight(FaceParameter& param);
+    void computeShadingWithSphericalHarmonics(const Face3DMMCoefficients& coefficients, FaceRenderContext& context);
 };
 
 
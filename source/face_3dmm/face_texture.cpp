@@ -0,0 +1,231 @@
+
+#include "face_texture.h"
+
+
+void FaceTexture::create(const cv::Mat& uv_texture, int layouts)
+{
+    if (source.empty()) {
+        if (uv_texture.type() == CV_8UC4) {
+            source = uv_texture;
+        }
+        else if (uv_texture.type() == CV_8UC3) {
+            cv::cvtColor(uv_texture, source, cv::COLOR_BGR2BGRA);
+        }
+        else if (uv_texture.type() == CV_32FC4) {
+            uv_texture.convertTo(source, CV_8U);
+            texture_float = uv_texture.isContinuous() ? uv_texture : uv_texture.clone();
+        }
+        else {
+            CV_Error(cv::Error::StsUnsupportedFormat, "uv texture should be CV_8UC3, CV_8UC4 or CV_32FC4");
+        }
+    }
+    if ((layouts & FaceTextureMip) && texture_mip.levels.empty()) {
+        render_texture_build(source.ptr<uchar>(), source.rows, source.cols, static_cast<int>(source.step),
+            texture_mip);
+    }
+    if ((layouts & FaceTextureFloat) && texture_float.empty()) {
+        source.convertTo(texture_float, CV_32F);
+    }
+}
+
+void FaceTexture::release()
+{
+    source.release();
+    texture_float.release();
+    texture_mip.levels.clear();
+}
+
+bool FaceTexture::has(int layouts) const
+{
+    if (source.empty())
+        return false;
+    if ((layouts & FaceTextureMip) && texture_mip.levels.empty())
+        return false;
+    if ((layouts & FaceTextureFloat) && texture_float.empty())
+        return false;
+    return true;
+}
+
+size_t FaceTexture::bytes() const
+{
+    size_t size = source.total() * source.elemSize() + texture_float.total() * texture_float.elemSize();
+    for (const RenderTextureLevel& level : texture_mip.levels)
+        size += level.texels.size() * sizeof(unsigned int);
+    return size;
+}
+
+
+FaceTextureRegistry::FaceTextureRegistry()
+{
+
+}
+
+FaceTextureRegistry::~FaceTextureRegistry()
+{
+
+}
+
+void FaceTextureRegistry::setLayouts(int layouts)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->layouts = layouts;
+}
+
+void FaceTextureRegistry::setMemoryLimit(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    memory_limit = bytes;
+    evict(FaceTextureInvalid);
+}
+
+size_t FaceTextureRegistry::getMemoryUsed() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return memory_used;
+}
+
+FaceTextureHandle FaceTextureRegistry::load(const std::string& path)
+{
+    Entry entry;
+    entry.path = path;
+    std::lock_guard<std::mutex> lock(mutex);
+    return insert(entry);
+}
+
+FaceTextureHandle FaceTextureRegistry::add(const cv::Mat& uv_texture)
+{
+    Entry entry;
+    entry.image = uv_texture;
+    std::lock_guard<std::mutex> lock(mutex);
+    return insert(entry);
+}
+
+void FaceTextureRegistry::remove(FaceTextureHandle handle)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(handle);
+    if (it == entries.end())
+        return;
+    memory_used -= it->second.bytes + it->second.image_bytes;
+    recent.erase(it->second.position);
+    entries.erase(it);
+    for (auto track = track_textures.begin(); track != track_textures.end();) {
+        if (track->second == handle)
+            track = track_textures.erase(track);
+        else
+            ++track;
+    }
+}
+
+std::shared_ptr<const FaceTexture> FaceTextureRegistry::acquire(FaceTextureHandle handle)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return touch(handle);
+}
+
+void FaceTextureRegistry::bindTrack(int identity, FaceTextureHandle handle)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (entries.find(handle) != entries.end())
+        track_textures[identity] = handle;
+}
+
+void FaceTextureRegistry::unbindTrack(int identity)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    track_textures.erase(identity);
+}
+
+FaceTextureHandle FaceTextureRegistry::getTrack(int identity) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = track_textures.find(identity);
+    return it == track_textures.end() ? FaceTextureInvalid : it->second;
+}
+
+std::shared_ptr<const FaceTexture> FaceTextureRegistry::acquireTrack(int identity)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = track_textures.find(identity);
+    if (it == track_textures.end())
+        return nullptr;
+    return touch(it->second);
+}
+
+FaceTextureHandle FaceTextureRegistry::insert(Entry& entry)
+{
+    // 注册时就解码和预处理, 取用时不再有额外开销
+    if (prepare(entry) == false)
+        return FaceTextureInvalid;
+    FaceTextureHandle handle = next_handle++;
+    recent.push_front(handle);
+    entry.position = recent.begin();
+    entries[handle] = entry;
+    evict(handle);
+    return handle;
+}
+
+bool FaceTextureRegistry::prepare(Entry& entry)
+{
+    cv::Mat image = entry.image;
+    if (image.empty()) {
+        // 保留alpha通道, 灰度/16位的图转换为8位3/4通道
+        image = cv::imread(entry.path, cv::IMREAD_UNCHANGED);
+        if (image.empty())
+            return false;
+        if (image.depth() == CV_16U)
+            image.convertTo(image, CV_8U, 1.0 / 257.0);
+        if (image.channels() == 1)
+            cv::cvtColor(image, image, cv::COLOR_GRAY2BGR);
+        else if (image.channels() == 2)
+            image = cv::imread(entry.path, cv::IMREAD_COLOR);
+    }
+    // 不支持的格式只是注册失败, 不向调用者抛出异常
+    std::shared_ptr<FaceTexture> texture = std::make_shared<FaceTexture>();
+    try {
+        texture->create(image, layouts);
+    }
+    catch (const cv::Exception&) {
+        return false;
+    }
+    entry.bytes = texture->bytes();
+    if (entry.path.empty()) {
+        // 只保留8位源图用于重建, 与纹理共用内存, 不再额外持有调用者的原图
+        entry.image = texture->source;
+        memory_used -= entry.image_bytes;
+        entry.image_bytes = entry.image.total() * entry.image.elemSize();
+        entry.bytes -= entry.image_bytes;
+        memory_used += entry.image_bytes;
+    }
+    entry.texture = texture;
+    memory_used += entry.bytes;
+    return true;
+}
+
+std::shared_ptr<const FaceTexture> FaceTextureRegistry::touch(FaceTextureHandle handle)
+{
+    auto it = entries.find(handle);
+    if (it == entries.end())
+        return nullptr;
+    Entry& entry = it->second;
+    recent.splice(recent.begin(), recent, entry.position);
+    if (entry.texture == nullptr) {
+        // 已被淘汰, 重新生成
+        if (prepare(entry) == false)
+            return nullptr;
+        evict(handle);
+    }
+    return entry.texture;
+}
+
+void FaceTextureRegistry::evict(FaceTextureHandle keep)
+{
+    for (auto it = recent.rbegin(); it != recent.rend() && memory_used > memory_limit; ++it) {
+        Entry& entry = entries[*it];
+        if (*it == keep || entry.texture == nullptr)
+            continue;
+        memory_used -= entry.bytes;
+        entry.bytes = 0;
+        entry.texture.reset();
+    }
+}
@@ -0,0 +1,91 @@
+
+#ifndef __Face_Texture__
+#define __Face_Texture__
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <opencv2/opencv.hpp>
+#include "singleton.h"
+#include "mesh_render.h"
+
+
+// 纹理的预处理版本
+enum FaceTextureLayout
+{
+    FaceTextureMip = 0x1,    // 8位mipmap, 延迟着色
+    FaceTextureFloat = 0x2,  // float, 逐像素路径
+    FaceTextureAll = FaceTextureMip | FaceTextureFloat,
+};
+
+// 预处理好的uv纹理, source为8位4通道(3通道补alpha), 未准备的版本为空
+struct FaceTexture
+{
+    cv::Mat source;             // h,w,4 uint8
+    cv::Mat texture_float;      // h,w,4 float32, 连续
+    RenderTexture texture_mip;
+
+    // 只生成还没有的版本, uv_texture为8位3/4通道或float32 4通道
+    void create(const cv::Mat& uv_texture, int layouts);
+    void release();
+    bool has(int layouts) const;
+    size_t bytes() const;
+};
+
+typedef int FaceTextureHandle;
+const FaceTextureHandle FaceTextureInvalid = -1;
+
+// 纹理注册表: 纹理在注册时解码和预处理, 渲染时按句柄取用, 跟踪的人脸可以各自绑定一个纹理
+// 预处理后的数据超过内存上限时按最近最少使用淘汰, 被淘汰的纹理在下次取用时从文件/原图重新生成
+// 内存中注册的纹理常驻其8位源图(与预处理结果共用), 计入内存但不会被淘汰
+// 取到的纹理由shared_ptr持有, 渲染过程中被淘汰也不会释放
+class FaceTextureRegistry
+{
+public:
+    THREAD_SAFE_SINGLETON_AUTOMATIC(FaceTextureRegistry);
+public:
+    FaceTextureRegistry();
+    ~FaceTextureRegistry();
+
+protected:
+    struct Entry
+    {
+        std::string path;   // 从文件加载
+        cv::Mat image;      // 或者内存中的原图, 预处理后换成纹理的8位源图
+        std::shared_ptr<const FaceTexture> texture;
+        size_t bytes = 0;        // 可淘汰的预处理数据
+        size_t image_bytes = 0;  // 常驻的源图
+        std::list<FaceTextureHandle>::iterator position;
+    };
+    mutable std::mutex mutex;
+    int layouts = FaceTextureMip;
+    size_t memory_limit = 256 << 20;
+    size_t memory_used = 0;
+    FaceTextureHandle next_handle = 0;
+    std::unordered_map<FaceTextureHandle, Entry> entries;
+    std::list<FaceTextureHandle> recent;  // 最近使用的在前
+    std::unordered_map<int, FaceTextureHandle> track_textures;
+
+public:
+    void setLayouts(int layouts);
+    void setMemoryLimit(size_t bytes);
+    size_t getMemoryUsed() const;
+    FaceTextureHandle load(const std::string& path);
+    FaceTextureHandle add(const cv::Mat& uv_texture);
+    void remove(FaceTextureHandle handle);
+    std::shared_ptr<const FaceTexture> acquire(FaceTextureHandle handle);
+public:
+    void bindTrack(int identity, FaceTextureHandle handle);
+    void unbindTrack(int identity);
+    FaceTextureHandle getTrack(int identity) const;
+    std::shared_ptr<const FaceTexture> acquireTrack(int identity);
+protected:
+    FaceTextureHandle insert(Entry& entry);
+    bool prepare(Entry& entry);
+    std::shared_ptr<const FaceTexture> touch(FaceTextureHandle handle);
+    void evict(FaceTextureHandle keep);
+};
+
+#endif
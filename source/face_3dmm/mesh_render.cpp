@@ -4,8 +4,14 @@
 #include <omp.h>
 #include <limits>
 #include <vector>
+#include <cstring>
 #include "mesh_render.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MESH_RENDER_USE_SSE2
+#endif
+
 
 // calculate barycentric coordinates
 inline void computeBaryCentric(
@@ -38,121 +44,377 @@ void render_rasterize(
     int h, int w,
     float* output // h*w*4
 )
+{
+    std::vector<float> z_buffer(h * w);
+    std::vector<float> pos_ndc(N * 3);
+    render_rasterize(pos, N, tri, M, proj, h, w, output, z_buffer.data(), pos_ndc.data());
+}
+
+// world -> clip space -> NDC of one vertex
+inline void project_vertex(float x, float y, float z, const float* proj, float* ndc)
+{
+    float clip0 = x * proj[0 * 4 + 0] + y * proj[1 * 4 + 0] + z * proj[2 * 4 + 0] + proj[3 * 4 + 0];
+    float clip1 = x * proj[0 * 4 + 1] + y * proj[1 * 4 + 1] + z * proj[2 * 4 + 1] + proj[3 * 4 + 1];
+    float clip2 = x * proj[0 * 4 + 2] + y * proj[1 * 4 + 2] + z * proj[2 * 4 + 2] + proj[3 * 4 + 2];
+    float clip3 = x * proj[0 * 4 + 3] + y * proj[1 * 4 + 3] + z * proj[2 * 4 + 3] + proj[3 * 4 + 3];
+    ndc[0] = clip0 / clip3;
+    ndc[1] = clip1 / clip3;
+    ndc[2] = clip2 / clip3;
+}
+
+static void project_vertices(const float* pos, int N, const float* proj, float* pos_ndc)
+{
+    #pragma omp parallel for num_threads(2)
+    for (int i = 0; i < N; ++i) {
+        project_vertex(pos[i * 3 + 0], pos[i * 3 + 1], pos[i * 3 + 2], proj, pos_ndc + i * 3);
+    }
+}
+
+#ifdef MESH_RENDER_USE_SSE2
+// 4 contiguous xyz vectors -> xxxx yyyy zzzz
+inline void load_xyz4(const float* in, __m128& x, __m128& y, __m128& z)
+{
+    __m128 p0 = _mm_loadu_ps(in + 0);
+    __m128 p1 = _mm_loadu_ps(in + 4);
+    __m128 p2 = _mm_loadu_ps(in + 8);
+    x = _mm_shuffle_ps(_mm_shuffle_ps(p0, p0, _MM_SHUFFLE(3, 0, 3, 0)),
+        _mm_shuffle_ps(p1, p2, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 1, 0));
+    y = _mm_shuffle_ps(_mm_shuffle_ps(p0, p1, _MM_SHUFFLE(0, 0, 1, 1)),
+        _mm_shuffle_ps(p1, p2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+    z = _mm_shuffle_ps(_mm_shuffle_ps(p0, p1, _MM_SHUFFLE(1, 1, 2, 2)),
+        _mm_shuffle_ps(p2, p2, _MM_SHUFFLE(3, 0, 3, 0)), _MM_SHUFFLE(1, 0, 2, 0));
+}
+
+// xxxx yyyy zzzz -> 4 contiguous xyz vectors
+inline void store_xyz4(float* out, __m128 x, __m128 y, __m128 z)
+{
+    __m128 xy_lo = _mm_unpacklo_ps(x, y);
+    __m128 xy_hi = _mm_unpackhi_ps(x, y);
+    _mm_storeu_ps(out + 0, _mm_shuffle_ps(xy_lo, _mm_shuffle_ps(z, x, _MM_SHUFFLE(1, 1, 0, 0)),
+        _MM_SHUFFLE(2, 0, 1, 0)));
+    _mm_storeu_ps(out + 4, _mm_shuffle_ps(_mm_shuffle_ps(y, z, _MM_SHUFFLE(1, 1, 1, 1)), xy_hi,
+        _MM_SHUFFLE(1, 0, 2, 0)));
+    _mm_storeu_ps(out + 8, _mm_shuffle_ps(_mm_shuffle_ps(z, xy_hi, _MM_SHUFFLE(2, 2, 2, 2)),
+        _mm_shuffle_ps(xy_hi, z, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0)));
+}
+#endif
+
+void render_transform(
+    const float* pos, int N,
+    const float* matrix, // 3x4
+    const float* proj, // 4x4 or null
+    float* output, // N*3
+    float* pos_ndc // N*3
+)
+{
+    const float* m = matrix;
+    const int blocks = N / 4;
+    #pragma omp parallel for num_threads(2)
+    for (int b = 0; b < blocks; ++b) {
+        const float* in = pos + b * 12;
+        float* out = output + b * 12;
+#ifdef MESH_RENDER_USE_SSE2
+        __m128 x, y, z;
+        load_xyz4(in, x, y, z);
+        __m128 r[3];
+        for (int k = 0; k < 3; ++k) {
+            r[k] = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(x, _mm_set1_ps(m[k * 4 + 0])), _mm_mul_ps(y, _mm_set1_ps(m[k * 4 + 1]))),
+                _mm_mul_ps(z, _mm_set1_ps(m[k * 4 + 2]))), _mm_set1_ps(m[k * 4 + 3]));
+        }
+        store_xyz4(out, r[0], r[1], r[2]);
+#else
+        for (int i = 0; i < 4; ++i) {
+            const float* v = in + i * 3;
+            float r[3];
+            for (int k = 0; k < 3; ++k)
+                r[k] = v[0] * m[k * 4 + 0] + v[1] * m[k * 4 + 1] + v[2] * m[k * 4 + 2] + m[k * 4 + 3];
+            out[i * 3 + 0] = r[0], out[i * 3 + 1] = r[1], out[i * 3 + 2] = r[2];
+        }
+#endif
+        if (proj != nullptr) {
+            for (int i = 0; i < 4; ++i)
+                project_vertex(out[i * 3 + 0], out[i * 3 + 1], out[i * 3 + 2], proj, pos_ndc + (b * 4 + i) * 3);
+        }
+    }
+    for (int i = blocks * 4; i < N; ++i) {
+        const float* v = pos + i * 3;
+        float* out = output + i * 3;
+        float r[3];
+        for (int k = 0; k < 3; ++k)
+            r[k] = v[0] * m[k * 4 + 0] + v[1] * m[k * 4 + 1] + v[2] * m[k * 4 + 2] + m[k * 4 + 3];
+        out[0] = r[0], out[1] = r[1], out[2] = r[2];
+        if (proj != nullptr)
+            project_vertex(out[0], out[1], out[2], proj, pos_ndc + i * 3);
+    }
+}
+
+// frustum and backface culling, false when the triangle is not drawn
+inline bool setup_triangle(
+    const float* pos, const float* pos_ndc, const int* tri, int t_idx,
+    int h, int w, RenderTriangle& s)
+{
+    int i0 = tri[t_idx * 3 + 0];
+    int i1 = tri[t_idx * 3 + 1];
+    int i2 = tri[t_idx * 3 + 2];
+    s.x0 = pos_ndc[i0 * 3 + 0], s.y0 = pos_ndc[i0 * 3 + 1], s.z0 = pos_ndc[i0 * 3 + 2];
+    s.x1 = pos_ndc[i1 * 3 + 0], s.y1 = pos_ndc[i1 * 3 + 1], s.z1 = pos_ndc[i1 * 3 + 2];
+    s.x2 = pos_ndc[i2 * 3 + 0], s.y2 = pos_ndc[i2 * 3 + 1], s.z2 = pos_ndc[i2 * 3 + 2];
+
+    // skip triangles completely outside the view frustum
+    s.z_min = std::min(std::min(s.z0, s.z1), s.z2);
+    if (std::max(std::max(s.z0, s.z1), s.z2) < -1.0f || s.z_min > 1.0f)
+        return false;
+
+    // world/clip space triangle vertices
+    float vx0 = pos[i0 * 3 + 0], vy0 = pos[i0 * 3 + 1], vz0 = pos[i0 * 3 + 2];
+    float vx1 = pos[i1 * 3 + 0], vy1 = pos[i1 * 3 + 1], vz1 = pos[i1 * 3 + 2];
+    float vx2 = pos[i2 * 3 + 0], vy2 = pos[i2 * 3 + 1], vz2 = pos[i2 * 3 + 2];
+
+    // compute triangle normal
+    float nx = (vy1 - vy0) * (vz2 - vz0) - (vz1 - vz0) * (vy2 - vy0);
+    float ny = (vz1 - vz0) * (vx2 - vx0) - (vx1 - vx0) * (vz2 - vz0);
+    float nz = (vx1 - vx0) * (vy2 - vy0) - (vy1 - vy0) * (vx2 - vx0);
+
+    // view direction (assuming the viewer is at the origin)
+    float dot = nx * vx0 + ny * vy0 + nz * vz0;
+    // backface culling
+    if (dot >= 0.0f)
+        return false;
+
+    // NDC -> pixel coordinates
+    auto ndc_to_pixel = [&](float v, int size) {
+        return (v + 1.0f) * 0.5f * (size - 1);
+    };
+    float px0 = ndc_to_pixel(s.x0, w);
+    float px1 = ndc_to_pixel(s.x1, w);
+    float px2 = ndc_to_pixel(s.x2, w);
+    float py0 = ndc_to_pixel(s.y0, h);
+    float py1 = ndc_to_pixel(s.y1, h);
+    float py2 = ndc_to_pixel(s.y2, h);
+    s.min_x = std::max(0, static_cast<int>(std::floor(std::min(std::min(px0, px1), px2)) - 1));
+    s.max_x = std::min(w - 1, static_cast<int>(std::ceil(std::max(std::max(px0, px1), px2)) + 1));
+    s.min_y = std::max(0, static_cast<int>(std::floor(std::min(std::min(py0, py1), py2)) - 1));
+    s.max_y = std::min(h - 1, static_cast<int>(std::ceil(std::max(std::max(py0, py1), py2)) + 1));
+    return s.min_x <= s.max_x && s.min_y <= s.max_y;
+}
+
+// depth test and write of every covered pixel in the tile [x0, x0 + tile_w) x [y0, y0 + tile_h),
+// equal depth goes to the lower triangle id so the result does not depend on the drawing order
+inline void draw_triangle(
+    const RenderTriangle& s, int t_idx, int h, int w,
+    int y0, int x0, int tile_h, int tile_w,
+    float* z_buffer, float* output)
+{
+    const float eps = 1e-5f;
+    const float id = static_cast<float>(t_idx + 1);
+    // bounding box test
+    const float min_xx = std::min(std::min(s.x0, s.x1), s.x2);
+    const float max_xx = std::max(std::max(s.x0, s.x1), s.x2);
+    const float min_yy = std::min(std::min(s.y0, s.y1), s.y2);
+    const float max_yy = std::max(std::max(s.y0, s.y1), s.y2);
+    const int y_begin = std::max(s.min_y, y0), y_end = std::min(s.max_y, y0 + tile_h - 1);
+    const int x_begin = std::max(s.min_x, x0), x_end = std::min(s.max_x, x0 + tile_w - 1);
+    for (int y = y_begin; y <= y_end; ++y) {
+        // map pixel center back to NDC
+        float ndc_y = (y + 0.5f) / static_cast<float>(h) * 2.0f - 1.0f;
+        if (!(min_yy <= ndc_y && ndc_y <= max_yy))
+            continue;
+        for (int x = x_begin; x <= x_end; ++x) {
+            float ndc_x = (x + 0.5f) / static_cast<float>(w) * 2.0f - 1.0f;
+            if (!(min_xx <= ndc_x && ndc_x <= max_xx))
+                continue;
+            // compute barycentric coordinates
+            float w0, w1, w2;
+            computeBaryCentric(
+                ndc_x, ndc_y, s.x0, s.y0, s.x1, s.y1, s.x2, s.y2,
+                &w0, &w1, &w2);
+            if (w0 >= -eps && w1 >= -eps && w2 >= -eps) {
+                float z_over_w = w0 * s.z0 + w1 * s.z1 + w2 * s.z2;
+                int idx = (y - y0) * tile_w + (x - x0);
+                #pragma omp critical
+                {
+                    if (z_over_w < z_buffer[idx] || (z_over_w == z_buffer[idx] && id < output[idx * 4 + 3])) {
+                        z_buffer[idx] = z_over_w;
+                        output[idx * 4 + 0] = std::max(w0, 0.0f);
+                        output[idx * 4 + 1] = std::max(w1, 0.0f);
+                        output[idx * 4 + 2] = z_over_w;
+                        output[idx * 4 + 3] = id;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void render_rasterize(
+    const float* pos, int N,
+    const int* tri, int M,
+    const float* proj, // 4x4
+    int h, int w,
+    float* output, // h*w*4
+    float* z_buffer, float* pos_ndc
+)
 {
     // z-buffer
-    float* z_buffer = new float[h * w];
     #pragma omp parallel for num_threads(2)
     for (int i = 0; i < h * w; ++i) {
         z_buffer[i] = std::numeric_limits<float>::infinity();
     }
+    if (proj != nullptr)
+        project_vertices(pos, N, proj, pos_ndc);
 
-    float* pos_ndc = new float[N * 3];
-    #pragma omp parallel for num_threads(2)
-    for (int i = 0; i < N; ++i) {
-        // world -> clip space
-        float x = pos[i * 3 + 0];
-        float y = pos[i * 3 + 1];
-        float z = pos[i * 3 + 2];
-        float clip0 = x * proj[0 * 4 + 0] + y * proj[1 * 4 + 0] + z * proj[2 * 4 + 0] + proj[3 * 4 + 0];
-        float clip1 = x * proj[0 * 4 + 1] + y * proj[1 * 4 + 1] + z * proj[2 * 4 + 1] + proj[3 * 4 + 1];
-        float clip2 = x * proj[0 * 4 + 2] + y * proj[1 * 4 + 2] + z * proj[2 * 4 + 2] + proj[3 * 4 + 2];
-        float clip3 = x * proj[0 * 4 + 3] + y * proj[1 * 4 + 3] + z * proj[2 * 4 + 3] + proj[3 * 4 + 3];
-        // clip space -> NDC
-        float wv = clip3;
-        pos_ndc[i * 3 + 0] = clip0 / wv;
-        pos_ndc[i * 3 + 1] = clip1 / wv;
-        pos_ndc[i * 3 + 2] = clip2 / wv;
-    }
-
-    float eps = 1e-5f;
     #pragma omp parallel for num_threads(2)
     for (int t_idx = 0; t_idx < M; ++t_idx) {
-        int i0 = tri[t_idx * 3 + 0];
-        int i1 = tri[t_idx * 3 + 1];
-        int i2 = tri[t_idx * 3 + 2];
-        float x0 = pos_ndc[i0 * 3 + 0], y0 = pos_ndc[i0 * 3 + 1], z0 = pos_ndc[i0 * 3 + 2];
-        float x1 = pos_ndc[i1 * 3 + 0], y1 = pos_ndc[i1 * 3 + 1], z1 = pos_ndc[i1 * 3 + 2];
-        float x2 = pos_ndc[i2 * 3 + 0], y2 = pos_ndc[i2 * 3 + 1], z2 = pos_ndc[i2 * 3 + 2];
-
-        // skip triangles completely outside the view frustum
-        if (std::max(std::max(z0, z1), z2) < -1.0f || std::min(std::min(z0, z1), z2) > 1.0f)
-            continue;
+        RenderTriangle s;
+        if (setup_triangle(pos, pos_ndc, tri, t_idx, h, w, s))
+            draw_triangle(s, t_idx, h, w, 0, 0, h, w, z_buffer, output);
+    }
+}
 
-        // NDC -> pixel coordinates
-        auto ndc_to_pixel = [&](float v, int size) {
-            return (v + 1.0f) * 0.5f * (size - 1);
-        };
-        float px0 = ndc_to_pixel(x0, w);
-        float px1 = ndc_to_pixel(x1, w);
-        float px2 = ndc_to_pixel(x2, w);
-        float py0 = ndc_to_pixel(y0, h);
-        float py1 = ndc_to_pixel(y1, h);
-        float py2 = ndc_to_pixel(y2, h);
-
-        // world/clip space triangle vertices
-        float vx0 = pos[i0 * 3 + 0], vy0 = pos[i0 * 3 + 1], vz0 = pos[i0 * 3 + 2];
-        float vx1 = pos[i1 * 3 + 0], vy1 = pos[i1 * 3 + 1], vz1 = pos[i1 * 3 + 2];
-        float vx2 = pos[i2 * 3 + 0], vy2 = pos[i2 * 3 + 1], vz2 = pos[i2 * 3 + 2];
-
-        // compute triangle normal
-        float nx = (vy1 - vy0) * (vz2 - vz0) - (vz1 - vz0) * (vy2 - vy0);
-        float ny = (vz1 - vz0) * (vx2 - vx0) - (vx1 - vx0) * (vz2 - vz0);
-        float nz = (vx1 - vx0) * (vy2 - vy0) - (vy1 - vy0) * (vx2 - vx0);
-
-        // view direction (assuming the viewer is at the origin)
-        float view_dir_x = vx0;
-        float view_dir_y = vy0;
-        float view_dir_z = vz0;
-
-        // dot product test
-        float dot = nx * view_dir_x + ny * view_dir_y + nz * view_dir_z;
-        // backface culling
-        if (dot >= 0.0f) continue;
-
-        int min_x = std::max(0, static_cast<int>(std::floor(std::min(std::min(px0, px1), px2)) - 1));
-        int max_x = std::min(w - 1, static_cast<int>(std::ceil(std::max(std::max(px0, px1), px2)) + 1));
-        int min_y = std::max(0, static_cast<int>(std::floor(std::min(std::min(py0, py1), py2)) - 1));
-        int max_y = std::min(h - 1, static_cast<int>(std::ceil(std::max(std::max(py0, py1), py2)) + 1));
-
-        for (int y = min_y; y <= max_y; ++y) {
-            for (int x = min_x; x <= max_x; ++x) {
-                // map pixel center back to NDC
-                float ndc_x = (x + 0.5f) / static_cast<float>(w) * 2.0f - 1.0f;
-                float ndc_y = (y + 0.5f) / static_cast<float>(h) * 2.0f - 1.0f;
-                // bounding box test
-                float min_xx = std::min(std::min(x0, x1), x2);
-                float max_xx = std::max(std::max(x0, x1), x2);
-                float min_yy = std::min(std::min(y0, y1), y2);
-                float max_yy = std::max(std::max(y0, y1), y2);
-                if (!(min_xx <= ndc_x && ndc_x <= max_xx && min_yy <= ndc_y && ndc_y <= max_yy))
-                    continue;
-                // compute barycentric coordinates
-                float w0, w1, w2;
-                computeBaryCentric(
-                    ndc_x, ndc_y, x0, y0, x1, y1, x2, y2,
-                    &w0, &w1, &w2);
-                if (w0 >= -eps && w1 >= -eps && w2 >= -eps) {
-                    float w0_clamp = std::max(w0, 0.0f);
-                    float w1_clamp = std::max(w1, 0.0f);
-                    float z_over_w = w0 * z0 + w1 * z1 + w2 * z2;
-                    int idx = y * w + x;
-                    #pragma omp critical
-                    {
-                        if (z_over_w < z_buffer[idx]) {
-                            z_buffer[idx] = z_over_w;
-                            output[idx * 4 + 0] = w0_clamp;
-                            output[idx * 4 + 1] = w1_clamp;
-                            output[idx * 4 + 2] = z_over_w;
-                            output[idx * 4 + 3] = static_cast<float>(t_idx + 1);
-                        }
-                    }
+void render_rasterize_coherent(
+    const float* pos, int N,
+    const int* tri, int M,
+    const float* proj, // 4x4
+    int h, int w,
+    float* output, // h*w*4
+    float* z_buffer, float* pos_ndc,
+    RenderRasterCache& cache
+)
+{
+    // z-buffer
+    #pragma omp parallel for num_threads(2)
+    for (int i = 0; i < h * w; ++i) {
+        z_buffer[i] = std::numeric_limits<float>::infinity();
+    }
+    if (proj != nullptr)
+        project_vertices(pos, N, proj, pos_ndc);
+
+    // triangles around each vertex
+    if (static_cast<int>(cache.vertex_offset.size()) != N + 1 || static_cast<int>(cache.vertex_triangles.size()) != M * 3) {
+        cache.vertex_offset.assign(N + 1, 0);
+        cache.vertex_triangles.resize(M * 3);
+        for (int i = 0; i < M * 3; ++i)
+            cache.vertex_offset[tri[i] + 1]++;
+        for (int i = 0; i < N; ++i)
+            cache.vertex_offset[i + 1] += cache.vertex_offset[i];
+        std::vector<int> fill(cache.vertex_offset.begin(), cache.vertex_offset.end() - 1);
+        for (int i = 0; i < M * 3; ++i)
+            cache.vertex_triangles[fill[tri[i]]++] = i / 3;
+        cache.visible.clear();
+    }
+
+    // seed the z-buffer with the triangles visible in the last frame and their neighbours
+    cache.seeded.assign(M, 0);
+    cache.marked.assign(N, 0);
+    cache.seeds.clear();
+    for (int t_idx : cache.visible) {
+        for (int c = 0; c < 3; ++c) {
+            int v = tri[t_idx * 3 + c];
+            if (cache.marked[v])
+                continue;
+            cache.marked[v] = 1;
+            for (int k = cache.vertex_offset[v]; k < cache.vertex_offset[v + 1]; ++k) {
+                int t = cache.vertex_triangles[k];
+                if (cache.seeded[t] == 0) {
+                    cache.seeded[t] = 1;
+                    cache.seeds.push_back(t);
                 }
             }
         }
     }
+    const int num_seeds = static_cast<int>(cache.seeds.size());
+    #pragma omp parallel for num_threads(2)
+    for (int n = 0; n < num_seeds; ++n) {
+        int t_idx = cache.seeds[n];
+        RenderTriangle s;
+        if (setup_triangle(pos, pos_ndc, tri, t_idx, h, w, s))
+            draw_triangle(s, t_idx, h, w, 0, 0, h, w, z_buffer, output);
+    }
 
-    delete[] z_buffer;
-    delete[] pos_ndc;
+    // coarse z: the farthest depth of every tile, the z-buffer only gets nearer from here
+    // so a triangle nearer than no tile it overlaps cannot pass the depth test anywhere
+    const int tile = cache.tile_size;
+    const int tiles_x = (w + tile - 1) / tile;
+    const int tiles_y = (h + tile - 1) / tile;
+    cache.tile_max.resize(tiles_x * tiles_y);
+    #pragma omp parallel for num_threads(2)
+    for (int ty = 0; ty < tiles_y; ++ty) {
+        for (int tx = 0; tx < tiles_x; ++tx) {
+            float z_max = -std::numeric_limits<float>::infinity();
+            for (int y = ty * tile; y < std::min(h, (ty + 1) * tile); ++y)
+                for (int x = tx * tile; x < std::min(w, (tx + 1) * tile); ++x)
+                    z_max = std::max(z_max, z_buffer[y * w + x]);
+            cache.tile_max[ty * tiles_x + tx] = z_max;
+        }
+    }
+
+    #pragma omp parallel for num_threads(2)
+    for (int t_idx = 0; t_idx < M; ++t_idx) {
+        RenderTriangle s;
+        if (cache.seeded[t_idx] || !setup_triangle(pos, pos_ndc, tri, t_idx, h, w, s))
+            continue;
+        bool occluded = true;
+        for (int ty = s.min_y / tile; ty <= s.max_y / tile && occluded; ++ty)
+            for (int tx = s.min_x / tile; tx <= s.max_x / tile && occluded; ++tx)
+                occluded = s.z_min > cache.tile_max[ty * tiles_x + tx];
+        if (!occluded)
+            draw_triangle(s, t_idx, h, w, 0, 0, h, w, z_buffer, output);
+    }
+
+    // visible set for the next frame
+    cache.seeded.assign(M, 0);
+    cache.visible.clear();
+    for (int i = 0; i < h * w; ++i) {
+        int t_idx = static_cast<int>(output[i * 4 + 3]) - 1;
+        if (t_idx >= 0 && t_idx < M && cache.seeded[t_idx] == 0) {
+            cache.seeded[t_idx] = 1;
+            cache.visible.push_back(t_idx);
+        }
+    }
+}
+
+void render_setup(
+    const float* pos, int N,
+    const int* tri, int M,
+    const float* proj, // 4x4
+    int h, int w,
+    float* pos_ndc,
+    RenderTriangle* triangles // M
+)
+{
+    if (proj != nullptr)
+        project_vertices(pos, N, proj, pos_ndc);
+    #pragma omp parallel for num_threads(2)
+    for (int t_idx = 0; t_idx < M; ++t_idx) {
+        RenderTriangle& s = triangles[t_idx];
+        if (!setup_triangle(pos, pos_ndc, tri, t_idx, h, w, s)) {
+            s.min_x = s.min_y = 0;
+            s.max_x = s.max_y = -1;
+        }
+    }
+}
+
+void render_rasterize_tile(
+    const RenderTriangle* triangles, int M,
+    int h, int w,
+    int y0, int x0, int tile_h, int tile_w,
+    float* output, // tile_h*tile_w*4
+    float* z_buffer // tile_h*tile_w
+)
+{
+    #pragma omp parallel for num_threads(2)
+    for (int i = 0; i < tile_h * tile_w; ++i) {
+        z_buffer[i] = std::numeric_limits<float>::infinity();
+    }
+
+    #pragma omp parallel for num_threads(2)
+    for (int t_idx = 0; t_idx < M; ++t_idx) {
+        const RenderTriangle& s = triangles[t_idx];
+        if (s.max_x < x0 || s.min_x >= x0 + tile_w || s.max_y < y0 || s.min_y >= y0 + tile_h)
+            continue;
+        draw_triangle(s, t_idx, h, w, y0, x0, tile_h, tile_w, z_buffer, output);
+    }
 }
 
 void render_interpolate(
@@ -230,4 +492,451 @@ void render_texture(
             }
         }
     }
-}
\ No newline at end of file
+}
+
+void render_triangle_table(
+    const float* attr, int N, int num_attr,
+    const int* tri, int M,
+    float* table
+)
+{
+    for (int t = 0; t < M; ++t) {
+        const int* corners = tri + t * 3;
+        float* out = table + t * 3 * num_attr;
+        bool valid = corners[0] < N && corners[1] < N && corners[2] < N;
+        for (int c = 0; c < 3; ++c) {
+            for (int k = 0; k < num_attr; ++k)
+                out[c * num_attr + k] = valid ? attr[corners[c] * num_attr + k] : 0.0f;
+        }
+    }
+}
+
+// clamped barycentric weights and the triangle of a rasterized pixel, false for the background
+inline bool fetch_weights(const float* rast, int idx, int M, int& t_idx, float& w0, float& w1, float& w2)
+{
+    float triangle_id = rast[idx * 4 + 3];
+    t_idx = static_cast<int>(triangle_id - 1);
+    if (triangle_id == 0 || t_idx < 0 || t_idx >= M)
+        return false;
+    w0 = rast[idx * 4 + 0];
+    w1 = rast[idx * 4 + 1];
+    w2 = 1.0f - w0 - w1;
+    if (w0 < 0 || w1 < 0 || w2 < 0) {
+        w0 = std::max(w0, 0.0f);
+        w1 = std::max(w1, 0.0f);
+        w2 = std::max(1.0f - w0 - w1, 0.0f);
+    }
+    return true;
+}
+
+void render_interpolate_table(
+    const float* table, int num_attr,
+    const float* rast, int h, int w, int M,
+    float* output // h * w * num_attr
+)
+{
+    #pragma omp parallel for num_threads(2)
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            int idx = y * w + x;
+            int t_idx;
+            float w0, w1, w2;
+            if (!fetch_weights(rast, idx, M, t_idx, w0, w1, w2))
+                continue;
+            const float* a0 = table + t_idx * 3 * num_attr;
+            const float* a1 = a0 + num_attr;
+            const float* a2 = a1 + num_attr;
+            float* out = output + idx * num_attr;
+            for (int k = 0; k < num_attr; ++k)
+                out[k] = w0 * a0[k] + w1 * a1[k] + w2 * a2[k];
+        }
+    }
+}
+
+// vertices and clamped barycentric weights of a rasterized pixel, false for the background
+inline bool fetch_triangle(
+    const float* rast, int idx, const int* tri, int M, int N,
+    int& t_idx, int& i0, int& i1, int& i2, float& w0, float& w1, float& w2)
+{
+    if (!fetch_weights(rast, idx, M, t_idx, w0, w1, w2))
+        return false;
+    i0 = tri[t_idx * 3 + 0];
+    i1 = tri[t_idx * 3 + 1];
+    i2 = tri[t_idx * 3 + 2];
+    return i0 < N && i1 < N && i2 < N;
+}
+
+inline unsigned char saturate_u8(float v)
+{
+    int i = static_cast<int>(std::lrint(v));
+    return static_cast<unsigned char>(std::min(std::max(i, 0), 255));
+}
+
+// the per-row depth ranges folded into range (min, max)
+static void reduce_range(const std::vector<float>& row_min, const std::vector<float>& row_max, float* range)
+{
+    for (size_t y = 0; y < row_min.size(); ++y) {
+        range[0] = std::min(range[0], row_min[y]);
+        range[1] = std::max(range[1], row_max[y]);
+    }
+}
+
+void render_resolve_depth(
+    const float* depth_buffer, const unsigned char* mask, int h, int w,
+    const float* range,
+    unsigned char* depth)
+{
+    const float d_min = range[0], d_max = range[1];
+    if (d_max <= d_min) {
+        std::fill(depth, depth + h * w, static_cast<unsigned char>(0));
+        return;
+    }
+
+    const float scale = 255.0f / (d_max - d_min);
+    #pragma omp parallel for num_threads(2)
+    for (int y = 0; y < h; ++y) {
+        int x = 0;
+#ifdef MESH_RENDER_USE_SSE2
+        // 16 pixels per step: normalize, clamp and invert in float, truncate and pack to bytes
+        const __m128 v_min = _mm_set1_ps(d_min);
+        const __m128 v_scale = _mm_set1_ps(scale);
+        const __m128 v_zero = _mm_setzero_ps();
+        const __m128 v_255 = _mm_set1_ps(255.0f);
+        for (; x + 16 <= w; x += 16) {
+            int idx = y * w + x;
+            __m128i v[4];
+            for (int k = 0; k < 4; ++k) {
+                __m128 val = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(depth_buffer + idx + k * 4), v_min), v_scale);
+                val = _mm_min_ps(_mm_max_ps(val, v_zero), v_255);
+                v[k] = _mm_cvttps_epi32(_mm_sub_ps(v_255, val));
+            }
+            __m128i out = _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+            __m128i outside = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(mask + idx)),
+                _mm_setzero_si128());
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(depth + idx), _mm_andnot_si128(outside, out));
+        }
+#endif
+        for (; x < w; ++x) {
+            int idx = y * w + x;
+            float val = (depth_buffer[idx] - d_min) * scale;
+            val = std::min(std::max(val, 0.0f), 255.0f);
+            depth[idx] = mask[idx] ? static_cast<unsigned char>(255.0f - val) : 0;
+        }
+    }
+}
+
+void render_deferred_shape_tile(
+    const float* rast, int h, int w,
+    const int* tri, int M,
+    const float* vertex_z, const float* shading, int N,
+    int step,
+    unsigned char* color, unsigned char* mask, float* depth_buffer,
+    float* range
+)
+{
+    std::vector<float> row_min(h), row_max(h);
+    #pragma omp parallel for num_threads(2)
+    for (int y = 0; y < h; ++y) {
+        float r_min = std::numeric_limits<float>::max();
+        float r_max = -std::numeric_limits<float>::max();
+        for (int x = 0; x < w; ++x) {
+            int idx = y * w + x;
+            int out = y * step + x;
+            int t_idx, i0, i1, i2;
+            float w0, w1, w2;
+            mask[out] = rast[idx * 4 + 3] > 0 ? 255 : 0;
+            if (!fetch_triangle(rast, idx, tri, M, N, t_idx, i0, i1, i2, w0, w1, w2)) {
+                color[out * 3 + 0] = color[out * 3 + 1] = color[out * 3 + 2] = 0;
+                depth_buffer[out] = 0.0f;
+                continue;
+            }
+            for (int k = 0; k < 3; ++k) {
+                float v = w0 * shading[i0 * 3 + k] + w1 * shading[i1 * 3 + k] + w2 * shading[i2 * 3 + k];
+                color[out * 3 + k] = saturate_u8(v * 255.0f);
+            }
+            float d = w0 * vertex_z[i0] + w1 * vertex_z[i1] + w2 * vertex_z[i2];
+            depth_buffer[out] = d;
+            if (mask[out] && d > 0) {
+                r_min = std::min(r_min, d);
+                r_max = std::max(r_max, d);
+            }
+        }
+        row_min[y] = r_min;
+        row_max[y] = r_max;
+    }
+    reduce_range(row_min, row_max, range);
+}
+
+// texel (x, y) of a level stored in 4x4 blocks
+inline int texel_index(int x, int y, int blocks_w)
+{
+    return (((y >> 2) * blocks_w + (x >> 2)) << 4) + ((y & 3) << 2) + (x & 3);
+}
+
+void render_texture_build(
+    const unsigned char* texture, int h, int w, int step,
+    RenderTexture& mip
+)
+{
+    mip.levels.clear();
+    while (true) {
+        mip.levels.emplace_back();
+        RenderTextureLevel& level = mip.levels.back();
+        level.h = h;
+        level.w = w;
+        level.blocks_w = (w + 3) / 4;
+        level.texels.assign(level.blocks_w * ((h + 3) / 4) * 16, 0u);
+        if (mip.levels.size() == 1) {
+            for (int y = 0; y < h; ++y) {
+                const unsigned char* row = texture + y * step;
+                for (int x = 0; x < w; ++x)
+                    std::memcpy(&level.texels[texel_index(x, y, level.blocks_w)], row + x * 4, 4);
+            }
+        }
+        else {
+            // 2x2 box filter of the previous level, the last row/column is repeated for odd sizes
+            const RenderTextureLevel& prev = mip.levels[mip.levels.size() - 2];
+            for (int y = 0; y < h; ++y) {
+                for (int x = 0; x < w; ++x) {
+                    int xs[2] = { std::min(x * 2, prev.w - 1), std::min(x * 2 + 1, prev.w - 1) };
+                    int ys[2] = { std::min(y * 2, prev.h - 1), std::min(y * 2 + 1, prev.h - 1) };
+                    unsigned char t[4][4];
+                    for (int n = 0; n < 4; ++n)
+                        std::memcpy(t[n], &prev.texels[texel_index(xs[n & 1], ys[n >> 1], prev.blocks_w)], 4);
+                    unsigned char out[4];
+                    for (int c = 0; c < 4; ++c)
+                        out[c] = static_cast<unsigned char>((t[0][c] + t[1][c] + t[2][c] + t[3][c] + 2) >> 2);
+                    std::memcpy(&level.texels[texel_index(x, y, level.blocks_w)], out, 4);
+                }
+            }
+        }
+        if (w == 1 && h == 1)
+            break;
+        w = std::max(w / 2, 1);
+        h = std::max(h / 2, 1);
+    }
+}
+
+// bilinear filter of four RGBA texels in 8.8 fixed point, fx/fy in [0, 256]
+inline unsigned int bilinear_u8(unsigned int t00, unsigned int t01, unsigned int t10, unsigned int t11, int fx, int fy)
+{
+#ifdef MESH_RENDER_USE_SSE2
+    // the four channels of two texels per register, 16 bits per channel
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi16(128);
+    const __m128i wx = _mm_set_epi16(
+        static_cast<short>(fx), static_cast<short>(fx), static_cast<short>(fx), static_cast<short>(fx),
+        static_cast<short>(256 - fx), static_cast<short>(256 - fx), static_cast<short>(256 - fx), static_cast<short>(256 - fx));
+    const __m128i wy = _mm_set_epi16(
+        static_cast<short>(fy), static_cast<short>(fy), static_cast<short>(fy), static_cast<short>(fy),
+        static_cast<short>(256 - fy), static_cast<short>(256 - fy), static_cast<short>(256 - fy), static_cast<short>(256 - fy));
+    __m128i top = _mm_unpacklo_epi8(_mm_unpacklo_epi32(
+        _mm_cvtsi32_si128(static_cast<int>(t00)), _mm_cvtsi32_si128(static_cast<int>(t01))), zero);
+    __m128i bot = _mm_unpacklo_epi8(_mm_unpacklo_epi32(
+        _mm_cvtsi32_si128(static_cast<int>(t10)), _mm_cvtsi32_si128(static_cast<int>(t11))), zero);
+    top = _mm_mullo_epi16(top, wx);
+    bot = _mm_mullo_epi16(bot, wx);
+    top = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(top, _mm_srli_si128(top, 8)), half), 8);
+    bot = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(bot, _mm_srli_si128(bot, 8)), half), 8);
+    __m128i v = _mm_mullo_epi16(_mm_unpacklo_epi64(top, bot), wy);
+    v = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(v, _mm_srli_si128(v, 8)), half), 8);
+    return static_cast<unsigned int>(_mm_cvtsi128_si32(_mm_packus_epi16(v, v)));
+#else
+    unsigned int out = 0;
+    for (int c = 0; c < 32; c += 8) {
+        unsigned int top = (((t00 >> c) & 0xFF) * (256 - fx) + ((t01 >> c) & 0xFF) * fx + 128) >> 8;
+        unsigned int bot = (((t10 >> c) & 0xFF) * (256 - fx) + ((t11 >> c) & 0xFF) * fx + 128) >> 8;
+        out |= ((top * (256 - fy) + bot * fy + 128) >> 8) << c;
+    }
+    return out;
+#endif
+}
+
+// uv in [0, 1], texel centers at 0 and size - 1 as in render_texture
+inline unsigned int sample_level(const RenderTextureLevel& level, float u, float v)
+{
+    float u_scaled = u * (level.w - 1);
+    float v_scaled = v * (level.h - 1);
+    int x0 = static_cast<int>(u_scaled);
+    int y0 = static_cast<int>(v_scaled);
+    int x1 = std::min(x0 + 1, level.w - 1);
+    int y1 = std::min(y0 + 1, level.h - 1);
+    int fx = static_cast<int>((u_scaled - x0) * 256.0f + 0.5f);
+    int fy = static_cast<int>((v_scaled - y0) * 256.0f + 0.5f);
+    const unsigned int* texels = level.texels.data();
+    return bilinear_u8(
+        texels[texel_index(x0, y0, level.blocks_w)], texels[texel_index(x1, y0, level.blocks_w)],
+        texels[texel_index(x0, y1, level.blocks_w)], texels[texel_index(x1, y1, level.blocks_w)], fx, fy);
+}
+
+// mip level of a triangle: log2 of texels per pixel, from its uv and screen areas
+inline int select_level(
+    const RenderTexture& texture, const float* uv,
+    const float* p0, const float* p1, const float* p2, float sx, float sy)
+{
+    const RenderTextureLevel& base = texture.levels[0];
+    float uv_area = std::fabs((uv[2] - uv[0]) * (uv[5] - uv[1]) - (uv[4] - uv[0]) * (uv[3] - uv[1]))
+        * (base.w - 1) * (base.h - 1);
+    float screen_area = std::fabs((p1[0] - p0[0]) * (p2[1] - p0[1]) - (p2[0] - p0[0]) * (p1[1] - p0[1])) * sx * sy;
+    const int coarsest = static_cast<int>(texture.levels.size()) - 1;
+    // a degenerate triangle on screen is only hit on its edges, take the coarsest level
+    if (!(screen_area > 0.0f))
+        return coarsest;
+    if (!(uv_area > screen_area * 2.0f))
+        return 0;
+    // clamp before the conversion, a tiny screen area still overflows the ratio
+    float level = std::floor(0.5f * std::log2(uv_area / screen_area) + 0.5f);
+    return level < static_cast<float>(coarsest) ? static_cast<int>(level) : coarsest;
+}
+
+void render_deferred_texture_tile(
+    const float* rast, int h, int w,
+    const int* tri, int M,
+    const float* vertex_z, const float* tri_uv, int N,
+    const RenderTexture& texture, const float* pos_ndc, int target_h, int target_w,
+    int step,
+    unsigned char* color, unsigned char* mask, float* depth_buffer,
+    float* range
+)
+{
+    // NDC -> pixels of the whole target
+    const float sx = 0.5f * target_w;
+    const float sy = 0.5f * target_h;
+    std::vector<float> row_min(h), row_max(h);
+    #pragma omp parallel for num_threads(2)
+    for (int y = 0; y < h; ++y) {
+        float r_min = std::numeric_limits<float>::max();
+        float r_max = -std::numeric_limits<float>::max();
+        int last_triangle = -1, level = 0;
+        for (int x = 0; x < w; ++x) {
+            int idx = y * w + x;
+            int out_idx = y * step + x;
+            int t_idx, i0, i1, i2;
+            float w0, w1, w2;
+            unsigned int texel = 0;
+            mask[out_idx] = rast[idx * 4 + 3] > 0 ? 255 : 0;
+            if (!fetch_triangle(rast, idx, tri, M, N, t_idx, i0, i1, i2, w0, w1, w2)) {
+                std::memcpy(color + out_idx * 4, &texel, 4);
+                depth_buffer[out_idx] = 0.0f;
+                continue;
+            }
+
+            const float* uv = tri_uv + t_idx * 6;
+            if (t_idx != last_triangle) {
+                level = select_level(texture, uv, pos_ndc + i0 * 3, pos_ndc + i1 * 3, pos_ndc + i2 * 3, sx, sy);
+                last_triangle = t_idx;
+            }
+            float u = w0 * uv[0] + w1 * uv[2] + w2 * uv[4];
+            float v = w0 * uv[1] + w1 * uv[3] + w2 * uv[5];
+            if (0.0f <= u && u <= 1.0f && 0.0f <= v && v <= 1.0f)
+                texel = sample_level(texture.levels[level], u, v);
+            std::memcpy(color + out_idx * 4, &texel, 4);
+
+            float d = w0 * vertex_z[i0] + w1 * vertex_z[i1] + w2 * vertex_z[i2];
+            depth_buffer[out_idx] = d;
+            if (mask[out_idx] && d > 0) {
+                r_min = std::min(r_min, d);
+                r_max = std::max(r_max, d);
+            }
+        }
+        row_min[y] = r_min;
+        row_max[y] = r_max;
+    }
+    reduce_range(row_min, row_max, range);
+}
+
+void render_deferred_depth(
+    const float* rast, int h, int w,
+    const int* tri, int M,
+    const float* vertex_z, int N,
+    unsigned char* mask, float* depth_buffer,
+    float* range
+)
+{
+    std::vector<float> row_min(h), row_max(h);
+    #pragma omp parallel for num_threads(2)
+    for (int y = 0; y < h; ++y) {
+        float r_min = std::numeric_limits<float>::max();
+        float r_max = -std::numeric_limits<float>::max();
+        for (int x = 0; x < w; ++x) {
+            int idx = y * w + x;
+            int t_idx, i0, i1, i2;
+            float w0, w1, w2;
+            mask[idx] = rast[idx * 4 + 3] > 0 ? 255 : 0;
+            if (!fetch_triangle(rast, idx, tri, M, N, t_idx, i0, i1, i2, w0, w1, w2)) {
+                depth_buffer[idx] = 0.0f;
+                continue;
+            }
+            float d = w0 * vertex_z[i0] + w1 * vertex_z[i1] + w2 * vertex_z[i2];
+            depth_buffer[idx] = d;
+            if (mask[idx] && d > 0) {
+                r_min = std::min(r_min, d);
+                r_max = std::max(r_max, d);
+            }
+        }
+        row_min[y] = r_min;
+        row_max[y] = r_max;
+    }
+    reduce_range(row_min, row_max, range);
+}
+
+void render_sh_shading(
+    const float* normals, const float* albedo, int N,
+    const float* gamma, // 3x9
+    float* shading // N*3
+)
+{
+    // the constants of the 9 basis functions folded into the coefficients, the irradiance of
+    // channel c is g[c][0] + g[c][1] y + g[c][2] z + g[c][3] x + g[c][4] xy + g[c][5] yz
+    // + g[c][6] (3z^2 - 1) + g[c][7] xz + g[c][8] (x^2 - y^2)
+    const double pi = 3.14159265358979323846;
+    const double a0 = pi, a1 = 2.0 * pi / std::sqrt(3.0), a2 = 2.0 * pi / std::sqrt(8.0);
+    const double c0 = 1.0 / std::sqrt(4.0 * pi), c1 = std::sqrt(3.0) / std::sqrt(4.0 * pi);
+    const double c2 = 3.0 * std::sqrt(5.0) / std::sqrt(12.0 * pi), d0 = 0.5 / std::sqrt(3.0);
+    const double basis[9] = { a0 * c0, -a1 * c1, a1 * c1, -a1 * c1, a2 * c2, -a2 * c2, a2 * c2 * d0, -a2 * c2, a2 * c2 * 0.5 };
+    float g[3][9];
+    for (int c = 0; c < 3; ++c)
+        for (int k = 0; k < 9; ++k)
+            g[c][k] = static_cast<float>(basis[k] * gamma[c * 9 + k]);
+
+    auto irradiance = [&](int c, float x, float y, float z) {
+        return g[c][0] + g[c][1] * y + g[c][2] * z + g[c][3] * x + g[c][4] * (x * y) + g[c][5] * (y * z)
+            + g[c][6] * (3.0f * (z * z) - 1.0f) + g[c][7] * (x * z) + g[c][8] * (x * x - y * y);
+    };
+
+    const int blocks = N / 4;
+    #pragma omp parallel for num_threads(2)
+    for (int b = 0; b < blocks; ++b) {
+        const float* n = normals + b * 12;
+        const float* t = albedo + b * 12;
+        float* out = shading + b * 12;
+#ifdef MESH_RENDER_USE_SSE2
+        __m128 x, y, z, tx, ty, tz;
+        load_xyz4(n, x, y, z);
+        load_xyz4(t, tx, ty, tz);
+        // the second order terms are shared by the three channels
+        const __m128 xy = _mm_mul_ps(x, y);
+        const __m128 yz = _mm_mul_ps(y, z);
+        const __m128 xz = _mm_mul_ps(x, z);
+        const __m128 zz = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(3.0f), _mm_mul_ps(z, z)), _mm_set1_ps(1.0f));
+        const __m128 xx_yy = _mm_sub_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y));
+        const __m128 terms[8] = { y, z, x, xy, yz, zz, xz, xx_yy };
+        __m128 r[3];
+        for (int c = 0; c < 3; ++c) {
+            __m128 sum = _mm_set1_ps(g[c][0]);
+            for (int k = 0; k < 8; ++k)
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(g[c][k + 1]), terms[k]));
+            r[c] = sum;
+        }
+        store_xyz4(out, _mm_mul_ps(r[0], tx), _mm_mul_ps(r[1], ty), _mm_mul_ps(r[2], tz));
+#else
+        for (int i = 0; i < 4; ++i)
+            for (int c = 0; c < 3; ++c)
+                out[i * 3 + c] = t[i * 3 + c] * irradiance(c, n[i * 3 + 0], n[i * 3 + 1], n[i * 3 + 2]);
+#endif
+    }
+    for (int i = blocks * 4; i < N; ++i) {
+        for (int c = 0; c < 3; ++c)
+            shading[i * 3 + c] = albedo[i * 3 + c] * irradiance(c, normals[i * 3 + 0], normals[i * 3 + 1], normals[i * 3 + 2]);
+    }
+}
@@ -1,6 +1,27 @@
 #ifndef __Mesh_Render__
 #define __Mesh_Render__
 
+#include <vector>
+
+
+// affine transform of N vertices, output = matrix (3x4, row-major) * [pos, 1], in one sweep
+// with the projection of render_rasterize folded in when proj (4x4) is given: pos_ndc (N*3)
+// then receives the NDC coordinates of the output; output may be pos
+void render_transform(
+    const float* pos, int N,
+    const float* matrix,
+    const float* proj,
+    float* output,
+    float* pos_ndc
+);
+
+// spherical harmonics lighting of N vertices with the 9-band basis of the 3DMM regression:
+// shading = albedo * (Y(normal) . gamma) per channel, gamma is 3x9 (channel major)
+void render_sh_shading(
+    const float* normals, const float* albedo, int N,
+    const float* gamma,
+    float* shading
+);
 
 void render_rasterize(
     const float* pos, int N,
@@ -10,6 +31,78 @@ void render_rasterize(
     float* output
 );
 
+// the same as above, with caller-owned scratch: z_buffer (h*w) and pos_ndc (N*3); with a null
+// proj pos_ndc already holds the projection of pos (render_transform), the same for the others
+void render_rasterize(
+    const float* pos, int N,
+    const int* tri, int M,
+    const float* proj,
+    int h, int w,
+    float* output,
+    float* z_buffer, float* pos_ndc
+);
+
+// screen space setup of one triangle, culled triangles have min_x > max_x
+struct RenderTriangle
+{
+    float x0, y0, z0, x1, y1, z1, x2, y2, z2;  // NDC
+    float z_min;
+    int min_x, max_x, min_y, max_y;            // pixel bounds in the h x w target
+};
+
+// projection, culling and setup of all triangles once for a h x w target
+void render_setup(
+    const float* pos, int N,
+    const int* tri, int M,
+    const float* proj,
+    int h, int w,
+    float* pos_ndc,
+    RenderTriangle* triangles
+);
+
+// rasterize the tile [x0, x0 + tile_w) x [y0, y0 + tile_h) of the h x w target,
+// output and z_buffer cover the tile only, so large targets need a bounded buffer
+void render_rasterize_tile(
+    const RenderTriangle* triangles, int M,
+    int h, int w,
+    int y0, int x0, int tile_h, int tile_w,
+    float* output,
+    float* z_buffer
+);
+
+// visibility kept across the frames of one face: the triangles visible in the last frame
+// and their neighbours are drawn first, the rest is culled against a tile-max depth of
+// that z-buffer. Triangles are about a pixel, so the neighbours fill the holes the motion
+// between two frames opens in the seeded z-buffer
+struct RenderRasterCache
+{
+    int tile_size = 8;
+    std::vector<int> visible;           // triangles visible in the last frame
+    std::vector<int> seeds;             // visible triangles and their neighbours
+    std::vector<unsigned char> seeded;  // M
+    std::vector<unsigned char> marked;  // N
+    std::vector<float> tile_max;        // farthest depth per tile
+    // triangles around each vertex, built once per topology
+    std::vector<int> vertex_offset;     // N+1
+    std::vector<int> vertex_triangles;  // M*3
+
+    void reset()
+    {
+        visible.clear();
+    }
+};
+
+// the same as render_rasterize with scratch, the output must be cleared by the caller
+void render_rasterize_coherent(
+    const float* pos, int N,
+    const int* tri, int M,
+    const float* proj,
+    int h, int w,
+    float* output,
+    float* z_buffer, float* pos_ndc,
+    RenderRasterCache& cache
+);
+
 void render_interpolate(
     const float* attr, int N, int num_attr,
     const float* rast, int h, int w,
@@ -23,4 +116,79 @@ void render_texture(
     float* output
 );
 
+// gather a per-vertex attribute into a per-triangle table (M * 3 * num_attr), the three
+// corners of a triangle are contiguous; triangles with an invalid vertex get zeros
+void render_triangle_table(
+    const float* attr, int N, int num_attr,
+    const int* tri, int M,
+    float* table
+);
+
+// render_interpolate on a table from render_triangle_table, one contiguous read per pixel
+void render_interpolate_table(
+    const float* table, int num_attr,
+    const float* rast, int h, int w, int M,
+    float* output // h * w * num_attr
+);
+
+// 8-bit 4-channel texture with its mip chain, the texels (4 bytes packed in one word) are
+// stored in 4x4 blocks so the 2x2 footprint of a bilinear lookup shares a cache line
+struct RenderTextureLevel
+{
+    int h = 0, w = 0;
+    int blocks_w = 0;
+    std::vector<unsigned int> texels;
+};
+
+struct RenderTexture
+{
+    std::vector<RenderTextureLevel> levels;
+};
+
+void render_texture_build(
+    const unsigned char* texture, int h, int w, int step,
+    RenderTexture& mip
+);
+
+// deferred shading: visibility is resolved by the rasterizer, then one pass per pixel writes
+// the 8-bit color, mask (255 on the face) and float depth of one tile: rast covers the tile
+// (h*w), the outputs start at the tile origin with rows of step pixels, and the depth range
+// (min, max) of the face is accumulated into range; render_resolve_depth turns depth_buffer
+// into the 8-bit depth (near is bright, 0 outside) after the last tile
+void render_deferred_shape_tile(
+    const float* rast, int h, int w,
+    const int* tri, int M,
+    const float* vertex_z, const float* shading, int N,
+    int step,
+    unsigned char* color, unsigned char* mask, float* depth_buffer,
+    float* range
+);
+
+// pos_ndc is the projection from the rasterizer, the mip level of every triangle is chosen
+// from its screen area in the target_h x target_w target; the color is 4 channels
+void render_deferred_texture_tile(
+    const float* rast, int h, int w,
+    const int* tri, int M,
+    const float* vertex_z, const float* tri_uv, int N,
+    const RenderTexture& texture, const float* pos_ndc, int target_h, int target_w,
+    int step,
+    unsigned char* color, unsigned char* mask, float* depth_buffer,
+    float* range
+);
+
+void render_resolve_depth(
+    const float* depth_buffer, const unsigned char* mask, int h, int w,
+    const float* range,
+    unsigned char* depth
+);
+
+// the mask and float depth of the deferred passes without color, range as in the tile passes
+void render_deferred_depth(
+    const float* rast, int h, int w,
+    const int* tri, int M,
+    const float* vertex_z, int N,
+    unsigned char* mask, float* depth_buffer,
+    float* range
+);
+
 #endif
\ No newline at end of file
@@ -1,6 +1,9 @@
 
 #include <cassert>
 #include <iostream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "face_align.h"
 #include "face_align.id.h"
 #include "face_align.mem.h"
@@ -26,6 +29,7 @@ const int FaceAlign::IndexContour[17] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
 FaceAlign::FaceAlign()
 {
 	initialize();
+	setNumWorkers(num_workers);
 }
 
 FaceAlign::~FaceAlign()
@@ -54,6 +58,16 @@ void FaceAlign::initialize(const char* path_param, const char* path_bin)
 	assert(net.load_param(path_param) == 0 && net.load_model(path_bin) == 0);
 }
 
+void FaceAlign::setNumWorkers(int num_workers)
+{
+	assert(num_workers > 0);
+	std::lock_guard<std::mutex> lock(workers_mutex);
+	this->num_workers = num_workers;
+	workers.clear();
+	for (int n = 0; n < num_workers; n++)
+		workers.emplace_back(new AlignWorker());
+}
+
 void FaceAlign::calculateBoundingBox(const int* previous, int num_points, XRectangle& rect)
 {
 	rect.from(previous, num_points);
@@ -76,7 +90,8 @@ void FaceAlign::calculateBoundingBox(const int* previous, int num_points, XRecta
 }
 
 void FaceAlign::preprocess(const unsigned char* input,
-	int in_height, int in_width, int in_channel, const int* previous, int num_points, ncnn::Mat& mat, XRectangle& rect)
+	int in_height, int in_width, int in_channel, const int* previous, int num_points, ncnn::Mat& mat, XRectangle& rect,
+	AlignWorker* worker)
 {
 	// calculate bounding box
 	calculateBoundingBox(previous, num_points, rect);
@@ -85,7 +100,10 @@ void FaceAlign::preprocess(const unsigned char* input,
 	// clip the face from the original face 
     int clip_width = rect.width();
 	int clip_height = rect.height();
-	unsigned char* clip_buffer = new unsigned char[clip_height * clip_width * in_channel]();
+	std::vector<unsigned char> local_buffer;
+	std::vector<unsigned char>& buffer = (worker != NULL) ? worker->clip_buffer : local_buffer;
+	buffer.assign(clip_height * clip_width * in_channel, 0);
+	unsigned char* clip_buffer = buffer.data();
 	for (int c = 0; c < in_channel; c++) {
 		for (int h = 0; h < clip_height; h++) 
 			for (int w = 0; w < clip_width; w++) {		
@@ -103,17 +121,20 @@ void FaceAlign::preprocess(const unsigned char* input,
 	const float mean_vals[] = { 0.f, 0.f, 0.f };
 	const float norm_vals[] = { 1 / 255.f, 1 / 255.f, 1 / 255.f };
 	mat = ncnn::Mat::from_pixels_resize(clip_buffer, ncnn::Mat::PIXEL_BGR, clip_width, clip_height,
-		FaceAlignNormWidth, FaceAlignNormHeight);
+		FaceAlignNormWidth, FaceAlignNormHeight, (worker != NULL) ? &worker->blob_allocator : NULL);
 	mat.substract_mean_normalize(mean_vals, norm_vals);
-
-	// release buffer
-	delete[] clip_buffer;
 }
 
-void FaceAlign::inference(ncnn::Mat& input, ncnn::Mat& output)
+void FaceAlign::inference(ncnn::Mat& input, ncnn::Mat& output, AlignWorker* worker, int ex_threads)
 {
 	ncnn::Extractor ex = net.create_extractor();
 	ex.set_light_mode(light_mode);
+	if (worker != NULL)
+	{
+		ex.set_num_threads(ex_threads);
+		ex.set_blob_allocator(&worker->blob_allocator);
+		ex.set_workspace_allocator(&worker->workspace_allocator);
+	}
 	ex.input(FaceAlign_OptParamID::BLOB_input, input);
 	ex.extract(FaceAlign_OptParamID::BLOB_output, output);
 }
@@ -140,3 +161,33 @@ void FaceAlign::pipeline(const unsigned char* input, int in_height, int in_width
 	inference(mat_input, mat_output);
 	postprocess(in_height, in_width, rect, mat_output, landmarks);
 }
+
+void FaceAlign::pipelineBatch(const unsigned char* input, int in_height, int in_width, int in_channel,
+	int num_points, const std::vector<const int*>& points, const std::vector<int*>& landmarks)
+{
+	const int num_faces = static_cast<int>(points.size());
+	assert(landmarks.size() == points.size());
+	assert(num_points == 2 || num_points == FaceAlignNumPoints);
+	if (num_faces == 0)
+		return;
+
+	// split the threads of ncnn between the concurrent extractors,
+	// every face writes only its own landmarks so the result does not depend on the order
+	std::lock_guard<std::mutex> lock(workers_mutex);
+	const int concurrency = StdMin(num_faces, num_workers);
+	const int ex_threads = StdMax(num_threads / concurrency, 1);
+	#pragma omp parallel for num_threads(concurrency) schedule(dynamic)
+	for (int n = 0; n < num_faces; n++)
+	{
+#ifdef _OPENMP
+		AlignWorker* worker = workers[omp_get_thread_num()].get();
+#else
+		AlignWorker* worker = workers[0].get();
+#endif
+		XRectangle rect;
+		ncnn::Mat mat_input, mat_output;
+		preprocess(input, in_height, in_width, in_channel, points[n], num_points, mat_input, rect, worker);
+		inference(mat_input, mat_output, worker, ex_threads);
+		postprocess(in_height, in_width, rect, mat_output, landmarks[n]);
+	}
+}
@@ -2,6 +2,9 @@
 #ifndef __Face_Align__
 #define __Face_Align__
 
+#include <memory>
+#include <mutex>
+#include <vector>
 #include "ncnn/net.h"
 #include "face_detection.h"
 #include "xelement.h"
@@ -23,19 +26,34 @@ protected:
 	bool light_mode = false;
 	bool use_gpu = true;
 	ncnn::Net net;
+	// each concurrent alignment owns its allocators and clip buffer, reused across frames; the
+	// layers of a multi-threaded extractor take workspace from their own omp threads, so that pool is locked
+	struct AlignWorker
+	{
+		ncnn::UnlockedPoolAllocator blob_allocator;
+		ncnn::PoolAllocator workspace_allocator;
+		std::vector<unsigned char> clip_buffer;
+	};
+	int num_workers = 4;
+	std::vector<std::unique_ptr<AlignWorker>> workers;
+	// the workers are shared by all callers of the singleton, one batch uses them at a time
+	std::mutex workers_mutex;
 
 protected:
 	void calculateBoundingBox(const int* previous, int num_points, XRectangle& rect);
 	void preprocess(const unsigned char* input, int in_height, int in_width, int in_channel,
-		const int* previous, int num_points, ncnn::Mat& mat, XRectangle& rect);
-	void inference(ncnn::Mat& input, ncnn::Mat& output); 
+		const int* previous, int num_points, ncnn::Mat& mat, XRectangle& rect, AlignWorker* worker = NULL);
+	void inference(ncnn::Mat& input, ncnn::Mat& output, AlignWorker* worker = NULL, int ex_threads = 0); 
 	void postprocess(int in_height, int in_width, XRectangle& rect, ncnn::Mat& mat, int* output);
 
 public:
 	virtual void initialize();
 	void initialize(const char* path_param, const char* path_bin);
+	void setNumWorkers(int num_workers);
 	void pipeline(const unsigned char* input, int in_height, int in_width, 
 		int in_channel, int num_points, const int* points, int* landmarks);
+	void pipelineBatch(const unsigned char* input, int in_height, int in_width, int in_channel, 
+		int num_points, const std::vector<const int*>& points, const std::vector<int*>& landmarks);
 
 public:
 	//static const int FaceAlignNumPoints = 68;
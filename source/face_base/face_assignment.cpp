@@ -0,0 +1,211 @@
+
+#include <cassert>
+#include <limits>
+#include <algorithm>
+#include "face_assignment.h"
+
+#ifndef StdMax
+#define StdMax(a,b)  (((a) > (b)) ? (a) : (b))
+#endif
+#ifndef StdMin
+#define StdMin(a,b)  (((a) < (b)) ? (a) : (b))
+#endif
+
+
+FaceAssignment::FaceAssignment()
+{
+
+}
+
+FaceAssignment::~FaceAssignment()
+{
+
+}
+
+void FaceAssignment::setMethod(AssignmentMethod method)
+{
+	this->method = method;
+}
+
+void FaceAssignment::setGate(float iou_gate)
+{
+	this->iou_gate = iou_gate;
+}
+
+void FaceAssignment::build(const int* pre_boxes, const int* pre_kinds, int num_pre,
+	const int* cur_boxes, int num_cur, int num_kinds)
+{
+	num_rows = num_cur;
+	num_cols = num_pre;
+
+	// group the previous boxes by kind (counting sort, stable)
+	group_begin.assign(num_kinds + 1, 0);
+	for (int j = 0; j < num_pre; j++)
+	{
+		assert(0 <= pre_kinds[j] && pre_kinds[j] < num_kinds);
+		group_begin[pre_kinds[j] + 1]++;
+	}
+	for (int k = 0; k < num_kinds; k++)
+		group_begin[k + 1] += group_begin[k];
+	order.resize(num_pre);
+	std::vector<int> offset(group_begin.begin(), group_begin.end() - 1);
+	for (int j = 0; j < num_pre; j++)
+	{
+		int c = offset[pre_kinds[j]]++;
+		order[c] = j;
+	}
+
+	// structure of arrays, computed once per previous box
+	pre_x_min.resize(num_pre);
+	pre_y_min.resize(num_pre);
+	pre_x_max.resize(num_pre);
+	pre_y_max.resize(num_pre);
+	pre_area.resize(num_pre);
+	for (int c = 0; c < num_pre; c++)
+	{
+		const int* box = pre_boxes + order[c] * 4;
+		pre_x_min[c] = static_cast<float>(box[0]);
+		pre_y_min[c] = static_cast<float>(box[1]);
+		pre_x_max[c] = static_cast<float>(box[2]);
+		pre_y_max[c] = static_cast<float>(box[3]);
+		pre_area[c] = (pre_x_max[c] - pre_x_min[c]) * (pre_y_max[c] - pre_y_min[c]);
+	}
+
+	// IoU matrix: every inner loop compares one current box with a contiguous
+	// group of previous boxes, branch free so that it can be vectorized
+	iou_matrix.assign(static_cast<size_t>(num_rows) * num_cols, 0.f);
+	const float* x_min = pre_x_min.data();
+	const float* y_min = pre_y_min.data();
+	const float* x_max = pre_x_max.data();
+	const float* y_max = pre_y_max.data();
+	const float* area = pre_area.data();
+	for (int i = 0; i < num_rows; i++)
+	{
+		float* row = iou_matrix.data() + static_cast<size_t>(i) * num_cols;
+		for (int k = 0; k < num_kinds; k++)
+		{
+			const int* box = cur_boxes + (i * num_kinds + k) * 4;
+			const float cx_min = static_cast<float>(box[0]);
+			const float cy_min = static_cast<float>(box[1]);
+			const float cx_max = static_cast<float>(box[2]);
+			const float cy_max = static_cast<float>(box[3]);
+			const float c_area = (cx_max - cx_min) * (cy_max - cy_min);
+			for (int c = group_begin[k]; c < group_begin[k + 1]; c++)
+			{
+				float iw = StdMax(StdMin(x_max[c], cx_max) - StdMax(x_min[c], cx_min), 0.f);
+				float ih = StdMax(StdMin(y_max[c], cy_max) - StdMax(y_min[c], cy_min), 0.f);
+				float inter = iw * ih;
+				float uni = area[c] + c_area - inter;
+				row[c] = (area[c] > 0.f && c_area > 0.f && uni > 0.f) ? inter / uni : 0.f;
+			}
+		}
+	}
+}
+
+void FaceAssignment::solve(std::vector<int>& match)
+{
+	match.assign(num_rows, -1);
+	if (num_rows == 0 || num_cols == 0)
+		return;
+
+	if (method == AssignmentMethod::Greedy)
+		solveGreedy(match);
+	else solveHungarian(match);
+
+	// grouped column --> input index, and apply the gate
+	for (int i = 0; i < num_rows; i++)
+	{
+		int c = match[i];
+		if (c == -1) continue;
+		float value = iou_matrix[static_cast<size_t>(i) * num_cols + c];
+		match[i] = (value > iou_gate) ? order[c] : -1;
+	}
+}
+
+void FaceAssignment::solveGreedy(std::vector<int>& match)
+{
+	// greedy by score: take the pairs in descending IoU
+	std::vector<int> pairs;
+	for (int n = 0; n < num_rows * num_cols; n++)
+		if (iou_matrix[n] > iou_gate) pairs.push_back(n);
+	std::stable_sort(pairs.begin(), pairs.end(),
+		[this](int a, int b) { return iou_matrix[a] > iou_matrix[b]; });
+
+	used.assign(num_cols, 0);
+	for (int n : pairs)
+	{
+		int i = n / num_cols, c = n % num_cols;
+		if (match[i] != -1 || used[c]) continue;
+		match[i] = c;
+		used[c] = 1;
+	}
+}
+
+void FaceAssignment::solveHungarian(std::vector<int>& match)
+{
+	// minimize sum(1 - iou) on the square matrix padded with zero-IoU entries,
+	// gated pairs have the same cost as padding and are rejected afterwards
+	const int n = StdMax(num_rows, num_cols);
+	auto cost = [this](int i, int j) -> double {
+		if (i >= num_rows || j >= num_cols) return 1.;
+		float value = iou_matrix[static_cast<size_t>(i) * num_cols + j];
+		return (value > iou_gate) ? 1. - value : 1.;
+	};
+
+	const double inf = std::numeric_limits<double>::max();
+	u.assign(n + 1, 0.);
+	v.assign(n + 1, 0.);
+	p.assign(n + 1, 0);
+	way.assign(n + 1, 0);
+	for (int i = 1; i <= n; i++)
+	{
+		p[0] = i;
+		int j0 = 0;
+		minv.assign(n + 1, inf);
+		used.assign(n + 1, 0);
+		do
+		{
+			used[j0] = 1;
+			int i0 = p[j0], j1 = 0;
+			double delta = inf;
+			for (int j = 1; j <= n; j++)
+			{
+				if (used[j]) continue;
+				double cur = cost(i0 - 1, j - 1) - u[i0] - v[j];
+				if (cur < minv[j])
+				{
+					minv[j] = cur;
+					way[j] = j0;
+				}
+				if (minv[j] < delta)
+				{
+					delta = minv[j];
+					j1 = j;
+				}
+			}
+			for (int j = 0; j <= n; j++)
+			{
+				if (used[j])
+				{
+					u[p[j]] += delta;
+					v[j] -= delta;
+				}
+				else minv[j] -= delta;
+			}
+			j0 = j1;
+		} while (p[j0] != 0);
+		do
+		{
+			int j1 = way[j0];
+			p[j0] = p[j1];
+			j0 = j1;
+		} while (j0 != 0);
+	}
+
+	for (int j = 1; j <= n; j++)
+	{
+		int i = p[j] - 1;
+		if (i < num_rows && j - 1 < num_cols)
+			match[i] = j - 1;
+	}
+}
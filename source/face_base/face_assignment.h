@@ -0,0 +1,50 @@
+
+#ifndef __Face_Assignment__
+#define __Face_Assignment__
+
+#include <vector>
+
+
+// Global association between current detections (rows) and previous objects (cols).
+// The IoU matrix is built once from precomputed boxes, then solved as a whole so
+// that one previous object can be claimed by at most one detection.
+class FaceAssignment
+{
+public:
+	FaceAssignment();
+	~FaceAssignment();
+
+public:
+	enum class AssignmentMethod
+	{
+		Greedy = 1, Hungarian = 2
+	};
+
+protected:
+	AssignmentMethod method = AssignmentMethod::Hungarian;
+	float iou_gate = 0.f;
+	int num_rows = 0;
+	int num_cols = 0;
+	std::vector<float> iou_matrix;
+	// previous boxes, structure of arrays
+	std::vector<float> pre_x_min, pre_y_min, pre_x_max, pre_y_max, pre_area;
+	// columns are grouped by kind, order maps a grouped column to the input index
+	std::vector<int> order, group_begin;
+	// workspace of hungarian
+	std::vector<double> u, v, minv;
+	std::vector<int> p, way;
+	std::vector<char> used;
+
+protected:
+	void solveGreedy(std::vector<int>& match);
+	void solveHungarian(std::vector<int>& match);
+
+public:
+	void setMethod(AssignmentMethod method);
+	void setGate(float iou_gate);
+	void build(const int* pre_boxes, const int* pre_kinds, int num_pre,
+		const int* cur_boxes, int num_cur, int num_kinds);
+	void solve(std::vector<int>& match);
+};
+
+#endif
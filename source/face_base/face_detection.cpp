@@ -132,6 +132,12 @@ void FaceDetector::decodePoints(ResizeInfo& rsz_info, const float* ptr_prior, co
 	}
 }
 
+FaceDetector::Scratch& FaceDetector::getScratch()
+{
+	static thread_local Scratch scratch;
+	return scratch;
+}
+
 void FaceDetector::doNonMaxSuppression(FaceObjectVector& proposals, FaceObjectVector& obj_vec)
 {
 	if (proposals.empty())
@@ -143,8 +149,11 @@ void FaceDetector::doNonMaxSuppression(FaceObjectVector& proposals, FaceObjectVe
 
 	// calculate each areas
 	const int n = proposals.size();
-	std::vector<int> picked;
-	std::vector<float> areas(n);
+	Scratch& scratch = getScratch();
+	std::vector<int>& picked = scratch.picked;
+	std::vector<float>& areas = scratch.areas;
+	picked.clear();
+	areas.resize(n);
 	for (int i = 0; i < n; i++)
 	{
 		FaceObject& obj = *proposals[i];
@@ -181,9 +190,7 @@ void FaceDetector::doNonMaxSuppression(FaceObjectVector& proposals, FaceObjectVe
 	{
 		// TODO: do not clear the vector, just push back
 		int index = picked[i];
-		obj_vec.push_back(proposals[index]);
-		//clean_proposals.push_back(proposals[index]);
-		proposals[index] = NULL;
+		obj_vec.push_back(proposals.take(index));
 	}
 
 	freeVector(proposals);
@@ -267,8 +274,9 @@ void FaceDetector::postprocess(ncnn::Mat& scores, ncnn::Mat& boxes, ncnn::Mat& p
 	const float* ptr_points = points.channel(0);
 	const float* ptr_anchors = prior_box.ptr_anchors;
 
-	// get proposals
-	FaceObjectVector proposals;
+	// get proposals, the objects come from the pool and the vector is reused
+	FaceObjectVector& proposals = getScratch().candidates;
+	proposals.clear();
 	for (int n = 0; n < num_proposals; n++)
 	{
 		const float prob = ptr_score[1];
@@ -388,8 +396,7 @@ void FaceDetector::transformBox(const FaceObject& obj, int* points)
 
 void FaceDetector::freeVector(FaceObjectVector& obj_vec)
 {
-	for (FaceObject* obj : obj_vec)
-		if (obj != NULL) delete obj;
+	// return the objects to the pool
 	obj_vec.clear();
 }
 
@@ -33,6 +33,17 @@ protected:
 	bool cfg_square_box = false;
 	float cfg_square_radio = 0.02f;
 
+protected:
+	// buffers of postprocess and NMS, one set per thread reused across frames, so concurrent
+	// detections do not share them and steady-state frames do not allocate
+	struct Scratch
+	{
+		FaceObjectVector candidates;
+		std::vector<int> picked;
+		std::vector<float> areas;
+	};
+	static Scratch& getScratch();
+
 protected:
 	class ResizeInfo
 	{
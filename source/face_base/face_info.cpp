@@ -0,0 +1,162 @@
+
+#include <cassert>
+#include "face_info.h"
+
+
+void* FaceObject::operator new(size_t size)
+{
+	assert(size == sizeof(FaceObject));
+	return FaceObjectPool::getInstance().acquire();
+}
+
+void FaceObject::operator delete(void* ptr)
+{
+	if (ptr != NULL)
+		FaceObjectPool::getInstance().release(ptr);
+}
+
+
+FaceObjectPool::FaceObjectPool()
+{
+
+}
+
+FaceObjectPool::~FaceObjectPool()
+{
+
+}
+
+void FaceObjectPool::grow()
+{
+	Slot* chunk = new Slot[ChunkSize];
+	chunks.emplace_back(chunk);
+	// the free list can hold every slot, so release never allocates
+	free_list.reserve(chunks.size() * ChunkSize);
+	for (int n = ChunkSize - 1; n >= 0; n--)
+		free_list.push_back(chunk[n].data);
+}
+
+void* FaceObjectPool::acquire()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (free_list.empty())
+		grow();
+	void* ptr = free_list.back();
+	free_list.pop_back();
+	return ptr;
+}
+
+void FaceObjectPool::release(void* ptr)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	free_list.push_back(ptr);
+}
+
+void FaceObjectPool::reserve(int num_objects)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	while (static_cast<int>(chunks.size()) * ChunkSize < num_objects)
+		grow();
+}
+
+int FaceObjectPool::capacity()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return static_cast<int>(chunks.size()) * ChunkSize;
+}
+
+int FaceObjectPool::available()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return static_cast<int>(free_list.size());
+}
+
+
+FaceObjectVector::FaceObjectVector()
+{
+	// the pool is completed before any owner of pooled objects, so it is destroyed after them
+	FaceObjectPool::getInstance();
+}
+
+FaceObjectVector::FaceObjectVector(const FaceObjectVector& other)
+{
+	*this = other;
+}
+
+FaceObjectVector::FaceObjectVector(FaceObjectVector&& other) noexcept
+	: items(std::move(other.items))
+{
+	other.items.clear();
+}
+
+FaceObjectVector::~FaceObjectVector()
+{
+	clear();
+}
+
+FaceObjectVector& FaceObjectVector::operator=(const FaceObjectVector& other)
+{
+	if (this != &other)
+	{
+		clear();
+		items.reserve(other.size());
+		for (const FaceObject* obj : other)
+			push_back(obj != NULL ? new FaceObject(*obj) : NULL);
+	}
+	return *this;
+}
+
+FaceObjectVector& FaceObjectVector::operator=(FaceObjectVector&& other) noexcept
+{
+	if (this != &other)
+	{
+		clear();
+		items.swap(other.items);
+	}
+	return *this;
+}
+
+void FaceObjectVector::reserve(size_t n)
+{
+	items.reserve(n);
+}
+
+void FaceObjectVector::push_back(FaceObject* obj)
+{
+	try
+	{
+		items.push_back(obj);
+	}
+	catch (...)
+	{
+		delete obj;
+		throw;
+	}
+}
+
+FaceObject* FaceObjectVector::take(size_t n)
+{
+	FaceObject* obj = items[n];
+	items[n] = NULL;
+	return obj;
+}
+
+FaceObjectVector::iterator FaceObjectVector::erase(iterator first, iterator last)
+{
+	for (iterator it = first; it != last; ++it)
+		delete *it;
+	return items.erase(first, last);
+}
+
+void FaceObjectVector::clear()
+{
+	// keep the capacity, the vector is reused frame after frame
+	for (FaceObject* obj : items)
+		delete obj;
+	items.clear();
+}
+
+void FaceObjectVector::swap(FaceObjectVector& other)
+{
+	items.swap(other.items);
+}
@@ -2,7 +2,11 @@
 #ifndef __Face_Information__
 #define __Face_Information__
 
+#include <cstddef>
+#include <memory>
+#include <mutex>
 #include <vector>
+#include "singleton.h"
 
 #define FaceAlignNumPoints		68
 #define FaceIdentityInvalid		-1
@@ -41,9 +45,84 @@ public:
 		frequency++; 
 		return StdMin(frequency, ObjectFrequencyMax);
 	}
+
+public:
+	// objects live in FaceObjectPool, new/delete do not reach the global allocator in steady state
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr);
+};
+
+
+// Fixed-size slots for FaceObject, allocated in chunks and recycled through a free list.
+// Slots are never moved nor returned to the system, so a pointer is a stable handle.
+class FaceObjectPool
+{
+public:
+	THREAD_SAFE_SINGLETON_AUTOMATIC(FaceObjectPool);
+public:
+	FaceObjectPool();
+	~FaceObjectPool();
+
+public:
+	static const int ChunkSize = 64;
+
+protected:
+	struct Slot
+	{
+		alignas(FaceObject) unsigned char data[sizeof(FaceObject)];
+	};
+	std::mutex mutex;
+	std::vector<std::unique_ptr<Slot[]>> chunks;
+	std::vector<void*> free_list;
+
+protected:
+	void grow();
+
+public:
+	void* acquire();
+	void release(void* ptr);
+	void reserve(int num_objects);
+	int capacity();
+	int available();
 };
 
-typedef std::vector<FaceObject*> FaceObjectVector;
+
+// Owning vector of pooled objects with value semantics: a copy is deep, and the objects
+// left in the vector are released on destruction, also when unwinding an exception.
+// A NULL entry has been handed over to another owner (see take).
+class FaceObjectVector
+{
+public:
+	typedef std::vector<FaceObject*>::iterator iterator;
+	typedef std::vector<FaceObject*>::const_iterator const_iterator;
+
+public:
+	FaceObjectVector();
+	FaceObjectVector(const FaceObjectVector& other);
+	FaceObjectVector(FaceObjectVector&& other) noexcept;
+	~FaceObjectVector();
+	FaceObjectVector& operator=(const FaceObjectVector& other);
+	FaceObjectVector& operator=(FaceObjectVector&& other) noexcept;
+
+protected:
+	std::vector<FaceObject*> items;
+
+public:
+	inline size_t size() const { return items.size(); }
+	inline bool empty() const { return items.empty(); }
+	inline FaceObject*& operator[](size_t n) { return items[n]; }
+	inline FaceObject* const& operator[](size_t n) const { return items[n]; }
+	inline iterator begin() { return items.begin(); }
+	inline iterator end() { return items.end(); }
+	inline const_iterator begin() const { return items.begin(); }
+	inline const_iterator end() const { return items.end(); }
+	void reserve(size_t n);
+	void push_back(FaceObject* obj);
+	FaceObject* take(size_t n);
+	iterator erase(iterator first, iterator last);
+	void clear();
+	void swap(FaceObjectVector& other);
+};
 
 #endif
 
@@ -0,0 +1,88 @@
+
+#include <cmath>
+#include "face_motion.h"
+
+
+FaceMotion::FaceMotion()
+	: FaceMotion(1.f, 4.f)
+{
+
+}
+
+FaceMotion::FaceMotion(float process_noise, float measure_noise)
+	: process_noise(process_noise), measure_noise(measure_noise)
+	, position(), velocity(), p00(0.f), p01(0.f), p11(0.f)
+	, last_frame(0), num_updates(0)
+{
+
+}
+
+FaceMotion::~FaceMotion()
+{
+
+}
+
+void FaceMotion::reset(const int* landmarks, unsigned int frame_num)
+{
+	for (int n = 0; n < NumStates; n++)
+	{
+		position[n] = static_cast<float>(landmarks[n]);
+		velocity[n] = 0.f;
+	}
+	// position is measured, velocity is unknown
+	p00 = measure_noise;
+	p01 = 0.f;
+	p11 = measure_noise;
+	last_frame = frame_num;
+	num_updates = 1;
+}
+
+void FaceMotion::predict(unsigned int frame_num, int* landmarks) const
+{
+	const float dt = static_cast<float>(frame_num - last_frame);
+	for (int n = 0; n < NumStates; n++)
+		landmarks[n] = static_cast<int>(round(position[n] + velocity[n] * dt));
+}
+
+void FaceMotion::update(const int* landmarks, unsigned int frame_num, int* filtered)
+{
+	if (num_updates == 0 || frame_num <= last_frame)
+	{
+		reset(landmarks, frame_num);
+		for (int n = 0; n < NumStates; n++)
+			filtered[n] = landmarks[n];
+		return;
+	}
+
+	// predict: x = F x, P = F P F^T + Q, with F = [1 dt; 0 1]
+	const float dt = static_cast<float>(frame_num - last_frame);
+	const float q = process_noise;
+	const float a00 = p00 + dt * (2.f * p01 + dt * p11) + q * dt * dt * dt / 3.f;
+	const float a01 = p01 + dt * p11 + q * dt * dt / 2.f;
+	const float a11 = p11 + q * dt;
+
+	// update with H = [1 0]
+	const float s = a00 + measure_noise;
+	const float k0 = a00 / s;
+	const float k1 = a01 / s;
+	for (int n = 0; n < NumStates; n++)
+	{
+		const float pred = position[n] + velocity[n] * dt;
+		const float innovation = static_cast<float>(landmarks[n]) - pred;
+		position[n] = pred + k0 * innovation;
+		velocity[n] = velocity[n] + k1 * innovation;
+		filtered[n] = static_cast<int>(round(position[n]));
+	}
+	p00 = (1.f - k0) * a00;
+	p01 = (1.f - k0) * a01;
+	p11 = a11 - k1 * a01;
+
+	last_frame = frame_num;
+	num_updates++;
+}
+
+bool FaceMotion::isWarm() const
+{
+	// velocity is observable after two measurements
+	return num_updates >= 2;
+}
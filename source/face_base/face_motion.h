@@ -0,0 +1,38 @@
+
+#ifndef __Face_Motion__
+#define __Face_Motion__
+
+#include "face_info.h"
+
+
+// Constant-velocity Kalman filter over the landmarks of one track.
+// Every coordinate has state (position, velocity) with the same noise model and
+// is updated at the same time, so a single 2x2 covariance is shared by all of them.
+class FaceMotion
+{
+public:
+	FaceMotion();
+	FaceMotion(float process_noise, float measure_noise);
+	~FaceMotion();
+
+public:
+	static const int NumStates = FaceAlignNumPoints * 2;
+
+protected:
+	float process_noise;
+	float measure_noise;
+	float position[NumStates];
+	float velocity[NumStates];
+	// shared covariance: [p00 p01; p01 p11]
+	float p00, p01, p11;
+	unsigned int last_frame;
+	int num_updates;
+
+public:
+	void reset(const int* landmarks, unsigned int frame_num);
+	void predict(unsigned int frame_num, int* landmarks) const;
+	void update(const int* landmarks, unsigned int frame_num, int* filtered);
+	bool isWarm() const;
+};
+
+#endif
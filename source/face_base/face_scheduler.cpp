@@ -0,0 +1,103 @@
+
+#include <cmath>
+#include "face_scheduler.h"
+
+#ifndef StdMax
+#define StdMax(a,b)  (((a) > (b)) ? (a) : (b))
+#endif
+#ifndef StdMin
+#define StdMin(a,b)  (((a) < (b)) ? (a) : (b))
+#endif
+
+
+FaceScheduler::FaceScheduler()
+{
+	reset(4);
+}
+
+FaceScheduler::~FaceScheduler()
+{
+
+}
+
+void FaceScheduler::reset(int interval)
+{
+	this->interval = StdMin(StdMax(interval, interval_minimum), interval_maximum);
+	last_detect = 0;
+	force_detect = true;
+	detected = false;
+	has_observation = false;
+	worst_iou = 1.f;
+	worst_motion = 0.f;
+	cost_detect = 0.f;
+	cost_track = 0.f;
+}
+
+void FaceScheduler::setLimits(int interval_minimum, int interval_maximum)
+{
+	this->interval_minimum = StdMax(interval_minimum, 1);
+	this->interval_maximum = StdMax(interval_maximum, this->interval_minimum);
+	interval = StdMin(StdMax(interval, this->interval_minimum), this->interval_maximum);
+}
+
+void FaceScheduler::setLatencyBudget(float budget_ms)
+{
+	latency_budget = StdMax(budget_ms, 0.f);
+}
+
+bool FaceScheduler::shouldDetect(unsigned int frame_num) const
+{
+	// a restarted sequence also triggers the detection
+	if (force_detect == true || frame_num < last_detect)
+		return true;
+	return static_cast<int>(frame_num - last_detect) >= interval;
+}
+
+void FaceScheduler::markDetected(unsigned int frame_num)
+{
+	last_detect = frame_num;
+	force_detect = false;
+	detected = true;
+}
+
+void FaceScheduler::observe(float iou, float motion)
+{
+	// the worst track decides for the whole frame
+	worst_iou = StdMin(worst_iou, iou);
+	worst_motion = StdMax(worst_motion, motion);
+	has_observation = true;
+}
+
+void FaceScheduler::finishFrame(float cost_ms)
+{
+	// running cost of both kinds of frame
+	float& cost = detected ? cost_detect : cost_track;
+	cost = (cost > 0.f) ? cost * cost_momentum + cost_ms * (1.f - cost_momentum) : cost_ms;
+
+	if (detected == false && has_observation == true)
+	{
+		if (worst_motion >= motion_large || worst_iou < iou_large)
+		{
+			// large motion: re-detect at once and sample faster
+			force_detect = true;
+			interval = StdMax(interval / 2, interval_minimum);
+		}
+		else if (worst_motion < motion_static && worst_iou > iou_static)
+		{
+			// static scene: sample slower
+			interval = StdMin(interval + 1, interval_maximum);
+		}
+	}
+
+	// amortized cost (detect + (k-1) * track) / k must fit in the budget
+	if (latency_budget > 0.f && cost_detect > latency_budget && cost_track > 0.f && cost_track < latency_budget)
+	{
+		int required = static_cast<int>(ceil((cost_detect - cost_track) / (latency_budget - cost_track)));
+		interval = StdMax(interval, StdMin(required, interval_maximum));
+	}
+
+	detected = false;
+	has_observation = false;
+	worst_iou = 1.f;
+	worst_motion = 0.f;
+}
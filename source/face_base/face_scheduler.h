@@ -0,0 +1,51 @@
+
+#ifndef __Face_Scheduler__
+#define __Face_Scheduler__
+
+
+// Adaptive key-frame scheduling for tracking: the interval between two
+// detections grows while the faces are static, collapses on large motion,
+// and is stretched when detection does not fit in the per-frame budget.
+class FaceScheduler
+{
+public:
+	FaceScheduler();
+	~FaceScheduler();
+
+protected:
+	// interval config
+	int interval_minimum = 1;
+	int interval_maximum = 32;
+	// motion is the landmark flow relative to the face size
+	float motion_static = 0.01f;
+	float motion_large = 0.1f;
+	float iou_static = 0.95f;
+	float iou_large = 0.8f;
+	// latency budget in ms, 0 for no budget
+	float latency_budget = 0.f;
+	float cost_momentum = 0.9f;
+
+protected:
+	int interval;
+	unsigned int last_detect;
+	bool force_detect;
+	bool detected;
+	// observation of the current frame
+	bool has_observation;
+	float worst_iou;
+	float worst_motion;
+	// average cost of the frames with and without detection
+	float cost_detect;
+	float cost_track;
+
+public:
+	void reset(int interval);
+	void setLimits(int interval_minimum, int interval_maximum);
+	void setLatencyBudget(float budget_ms);
+	bool shouldDetect(unsigned int frame_num) const;
+	void markDetected(unsigned int frame_num);
+	void observe(float iou, float motion);
+	void finishFrame(float cost_ms);
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include <iostream>
 #include "face_tracking.h"
 #include "face_detection.h"
+#include "tools/timer.h"
 //#define XDebug_FaceTracking
 #ifdef XDebug_FaceTracking
 #include "tools/strfunc.h"
@@ -18,6 +19,7 @@ FaceTracking::FaceTracking()
 	, face_align(FaceAlign::getInstance())
 {
 	assert(frequency_enter < sample_frequency);
+	face_scheduler.reset(sample_frequency);
 }
 
 FaceTracking::~FaceTracking()
@@ -42,6 +44,28 @@ void FaceTracking::setFrequencyEnter(int frequency_enter)
 	this->frequency_enter = frequency_enter;
 }
 
+void FaceTracking::setAssignment(FaceAssignment::AssignmentMethod method, float iou_gate)
+{
+	face_assignment.setMethod(method);
+	face_assignment.setGate(iou_gate);
+}
+
+void FaceTracking::setMotionModel(bool enable)
+{
+	this->use_motion = enable;
+	if (enable == false)
+		motions.clear();
+}
+
+void FaceTracking::setSchedule(bool adaptive, float latency_budget_ms, int interval_minimum, int interval_maximum)
+{
+	this->adaptive_schedule = adaptive;
+	// the limits clamp the initial interval, so they are set first
+	face_scheduler.setLimits(interval_minimum, interval_maximum);
+	face_scheduler.reset(sample_frequency);
+	face_scheduler.setLatencyBudget(latency_budget_ms);
+}
+
 void FaceTracking::finetuneFromLandmarks(FaceObject& obj)
 {
 	XRectangle rect;
@@ -86,6 +110,50 @@ void FaceTracking::smoothLandmarks(const int* previous, int* current)
 	}
 }
 
+bool FaceTracking::predictLandmarks(const FaceObject& obj, int* landmarks)
+{
+	// predict the landmarks of the current frame, or keep the previous ones
+	if (use_motion == true && obj.identity != FaceIdentityInvalid)
+	{
+		auto it = motions.find(obj.identity);
+		if (it != motions.end() && it->second.isWarm())
+		{
+			it->second.predict(frame_index, landmarks);
+			return true;
+		}
+	}
+	memcpy(landmarks, obj.landmarks, sizeof(int) * FaceAlignNumPoints * 2);
+	return false;
+}
+
+bool FaceTracking::filterLandmarks(FaceObject& cur)
+{
+	// kalman update instead of the fixed-momentum EMA
+	if (use_motion == false || cur.identity == FaceIdentityInvalid)
+		return false;
+	auto it = motions.find(cur.identity);
+	if (it == motions.end())
+	{
+		motions[cur.identity].reset(cur.landmarks, frame_index);
+		return false;
+	}
+	it->second.update(cur.landmarks, frame_index, cur.landmarks);
+	return true;
+}
+
+void FaceTracking::pruneMotions(const FaceObjectVector& obj_vec)
+{
+	for (auto it = motions.begin(); it != motions.end(); )
+	{
+		bool alive = false;
+		for (const FaceObject* obj : obj_vec)
+			alive = alive || (obj->identity == it->first);
+		if (alive == false)
+			it = motions.erase(it);
+		else ++it;
+	}
+}
+
 void FaceTracking::sortObjects(FaceObjectVector& obj_vec)
 {
 	auto sort_function = (method == SortingMethod::Score) ? FaceTracking::sortByScore : FaceTracking::sortByArea;
@@ -145,15 +213,15 @@ float FaceTracking::calculateFlow(const int* previous, const int* current, int n
 {
 	int flow_x = abs(previous[0] - current[0]);
 	int flow_y = abs(previous[1] - current[1]);
-	float flow_max = sqrt(flow_x ^ 2 + flow_y ^ 2);
+	float flow_max = sqrt(static_cast<float>(flow_x * flow_x + flow_y * flow_y));
 	for (int n = 1; n < num_points; n++)
 	{
+		previous += 2;
+		current += 2;
 		flow_x = abs(previous[0] - current[0]);
 		flow_y = abs(previous[1] - current[1]);
-		float flow = sqrt(flow_x ^ 2 + flow_y ^ 2);
+		float flow = sqrt(static_cast<float>(flow_x * flow_x + flow_y * flow_y));
 		flow_max = StdMax(flow, flow_max);
-		previous += 2;
-		current += 2;
 	}
 	return flow_max;
 }
@@ -168,12 +236,31 @@ bool FaceTracking::checkValid(const int* previous, const int* current, int num_p
 	return bool((iou > iou_threshold || flow < points_flow_maximum) && area > face_area_minimum);
 }
 
+bool FaceTracking::needDetection(unsigned int frame_num)
+{
+	if (adaptive_schedule == true)
+		return face_scheduler.shouldDetect(frame_num);
+	return frame_num % sample_frequency == 0;
+}
+
+void FaceTracking::observeMotion(const int* previous, const int* current)
+{
+	// displacement since the last observed landmarks, relative to the face size; the residual
+	// against the prediction would read a face moving at constant velocity as static
+	float iou = calculateIOU(previous, current, FaceAlignNumPoints);
+	float area = calculateArea(previous, FaceAlignNumPoints);
+	float flow = calculateFlow(previous, current, FaceAlignNumPoints);
+	face_scheduler.observe(iou, flow / sqrt(StdMax(area, 1.f)));
+}
+
 void FaceTracking::detectLocal(const unsigned char* input, int in_height, int in_width,
-	int in_channel, const FaceObject& obj, FaceObjectVector& obj_vec)
+	int in_channel, const int* landmarks, bool predicted, FaceObjectVector& obj_vec)
 {
+	// the prediction already follows the motion, so a smaller margin is enough
+	const float ratio = predicted ? local_expansion : 1.f;
 	XRectangle rect;
-	rect.from(obj.landmarks, FaceAlignNumPoints);
-	rect.expansion(1.f, 1.f);
+	rect.from(landmarks, FaceAlignNumPoints);
+	rect.expansion(ratio, ratio);
 	face_detector.detectSpecific(input, in_height, in_width, in_channel,
 		rect.y_min, rect.x_min, rect.y_max, rect.x_max, local_crop_height, local_crop_width, obj_vec);
 }
@@ -190,8 +277,11 @@ void FaceTracking::smoothPosition(const FaceObject& pre, FaceObject& cur)
 		else cur.identity = pre.identity;
 	}
 
-	smoothBox(pre.box, cur.box);
-	smoothLandmarks(pre.landmarks, cur.landmarks);
+	if (filterLandmarks(cur) == false)
+	{
+		smoothBox(pre.box, cur.box);
+		smoothLandmarks(pre.landmarks, cur.landmarks);
+	}
 	finetuneFromLandmarks(cur);
 }
 
@@ -204,7 +294,8 @@ void FaceTracking::smoothPosition(const int* landmarks, FaceObject& cur)
 			cur.identity = ++total_number;
 	}
 
-	smoothLandmarks(landmarks, cur.landmarks);
+	if (filterLandmarks(cur) == false)
+		smoothLandmarks(landmarks, cur.landmarks);
 	finetuneFromLandmarks(cur);
 }
 
@@ -229,6 +320,44 @@ int FaceTracking::findBestMatch(const FaceObjectVector& obj_vec, FaceObject& cur
 	return idx_max;
 }
 
+void FaceTracking::associateObjects(const FaceObjectVector& obj_vec_pre, const FaceObjectVector& obj_vec_cur, std::vector<int>& match)
+{
+	// box kinds: 0 for 5 points, 1 for landmarks
+	auto fill_box = [](const int* points, int num_points, int* box) {
+		XRectangle rect;
+		rect.from(points, num_points);
+		box[0] = rect.x_min;
+		box[1] = rect.y_min;
+		box[2] = rect.x_max;
+		box[3] = rect.y_max;
+	};
+
+	// previous: landmarks for objects with identity, 5 points for the others
+	const int num_pre = obj_vec_pre.size();
+	std::vector<int> pre_boxes(num_pre * 4), pre_kinds(num_pre);
+	for (int n = 0; n < num_pre; n++)
+	{
+		const FaceObject& obj = *obj_vec_pre[n];
+		pre_kinds[n] = (obj.identity != FaceIdentityInvalid) ? 1 : 0;
+		if (pre_kinds[n] == 1)
+			fill_box(obj.landmarks, FaceAlignNumPoints, &pre_boxes[n * 4]);
+		else fill_box(obj.points, 5, &pre_boxes[n * 4]);
+	}
+
+	// current: both kinds, each box is computed only once
+	const int num_cur = obj_vec_cur.size();
+	std::vector<int> cur_boxes(num_cur * 2 * 4);
+	for (int n = 0; n < num_cur; n++)
+	{
+		const FaceObject& obj = *obj_vec_cur[n];
+		fill_box(obj.points, 5, &cur_boxes[(n * 2 + 0) * 4]);
+		fill_box(obj.landmarks, FaceAlignNumPoints, &cur_boxes[(n * 2 + 1) * 4]);
+	}
+
+	face_assignment.build(pre_boxes.data(), pre_kinds.data(), num_pre, cur_boxes.data(), num_cur, 2);
+	face_assignment.solve(match);
+}
+
 void FaceTracking::updateCommon(const unsigned char* input, int in_height, int in_width, 
 	int in_channel, unsigned int frame_num, FaceObjectVector& obj_vec)
 {
@@ -236,19 +365,28 @@ void FaceTracking::updateCommon(const unsigned char* input, int in_height, int i
 
 	FaceObjectVector obj_vec_tmp;
 	face_detector.detectSingleScale(input, in_height, in_width, in_channel, obj_vec_tmp);
+	face_scheduler.markDetected(frame_num);
+
+	// calculate landmarks of all detections concurrently
+	std::vector<const int*> boxes(obj_vec_tmp.size());
+	std::vector<int*> landmarks(obj_vec_tmp.size());
+	for (int n = 0; n < obj_vec_tmp.size(); n++)
+	{
+		boxes[n] = obj_vec_tmp[n]->box;
+		landmarks[n] = obj_vec_tmp[n]->landmarks;
+	}
+	face_align.pipelineBatch(input, in_height, in_width, in_channel, 2, boxes, landmarks);
+
+	// global association, each previous object is matched at most once
+	std::vector<int> match;
+	associateObjects(obj_vec, obj_vec_tmp, match);
 
 	// assign objects
 	FaceObjectVector obj_vec_cur;
 	for (int n = 0; n < obj_vec_tmp.size(); n++)
 	{
 		FaceObject& obj_cur = *obj_vec_tmp[n];
-
-		// calculate landmarks
-		face_align.pipeline(input, in_height, in_width, in_channel,
-			2, obj_cur.box, obj_cur.landmarks);
-		
-		// find the best match in previous
-		int index = findBestMatch(obj_vec, obj_cur);
+		int index = match[n];
 
 		// match at least one object, then merge the previous into current
 		if (index != -1)
@@ -260,16 +398,14 @@ void FaceTracking::updateCommon(const unsigned char* input, int in_height, int i
 				obj_pre_match.identity, obj_pre_match.frequency);
 			std::cout << line << endl;
 		#endif
-			obj_vec_cur.push_back(obj_vec_tmp[n]);
-			obj_vec_tmp[n] = NULL;
+			obj_vec_cur.push_back(obj_vec_tmp.take(n));
 		}
 		else
 		{
 			// new object
 			if (frequency_enter == 0)
 				obj_cur.identity = ++total_number;
-			obj_vec_cur.push_back(obj_vec_tmp[n]);
-			obj_vec_tmp[n] = NULL;
+			obj_vec_cur.push_back(obj_vec_tmp.take(n));
 		}
 	}
 
@@ -285,35 +421,42 @@ void FaceTracking::updateCommon(const unsigned char* input, int in_height, int i
 void FaceTracking::updateFastAllFaces(const unsigned char* input, int in_height, int in_width, 
 	int in_channel, unsigned int frame_num, FaceObjectVector& obj_vec)
 {
-	if (frame_num % sample_frequency != 0)
+	if (needDetection(frame_num) == false)
 	{
 		// just tracking
 		if (obj_vec.size() > 0)
 		{
+			// re-detect all tracks concurrently based on the predicted landmarks
+			const int num_objects = obj_vec.size();
+			std::vector<int> predictions(num_objects * FaceAlignNumPoints * 2);
+			std::vector<int> previous(num_objects * FaceAlignNumPoints * 2);
+			std::vector<const int*> points(num_objects);
+			std::vector<int*> refined(num_objects);
+			for (int n = 0; n < num_objects; n++)
+			{
+				points[n] = &predictions[n * FaceAlignNumPoints * 2];
+				refined[n] = obj_vec[n]->landmarks;
+				memcpy(&previous[n * FaceAlignNumPoints * 2], obj_vec[n]->landmarks, sizeof(int) * FaceAlignNumPoints * 2);
+				predictLandmarks(*obj_vec[n], &predictions[n * FaceAlignNumPoints * 2]);
+			}
+			face_align.pipelineBatch(input, in_height, in_width, in_channel,
+				FaceAlignNumPoints, points, refined);
+
+			// merge in the original order, identities and motions stay deterministic
 			FaceObjectVector obj_vec_tmp;
-			for (int n = 0; n < obj_vec.size(); n++)
+			for (int n = 0; n < num_objects; n++)
 			{
 				FaceObject& obj = *obj_vec[n];
+				const int* landmarks = &previous[n * FaceAlignNumPoints * 2];
 
-				// re-detect based on landmarks
-				int landmarks[FaceAlignNumPoints * 2];
-				memcpy(landmarks, obj.landmarks, sizeof(int) * FaceAlignNumPoints * 2);
-				face_align.pipeline(input, in_height, in_width, in_channel,
-					FaceAlignNumPoints, landmarks, obj.landmarks);
-
-				// check based on IOU & area & flow
+				// check based on IOU & area & flow against the last observation, not the prediction
 				float iou, area, flow;
-				if (checkValid(landmarks, obj.landmarks,
-					FaceAlignNumPoints, iou, area, flow) == true)
+				bool valid = checkValid(landmarks, obj.landmarks, FaceAlignNumPoints, iou, area, flow);
+				observeMotion(landmarks, obj.landmarks);
+				if (valid == true)
 				{
 					smoothPosition(landmarks, obj);
-					obj_vec_tmp.push_back(obj_vec[n]);
-					obj_vec[n] = NULL;
-				}
-				else
-				{
-					delete obj_vec[n];
-					obj_vec[n] = NULL;
+					obj_vec_tmp.push_back(obj_vec.take(n));
 				}
 			}
 
@@ -338,27 +481,30 @@ void FaceTracking::updateFastAllFaces(const unsigned char* input, int in_height,
 void FaceTracking::updateFastOneFace(const unsigned char* input, int in_height, int in_width,
 	int in_channel, unsigned int frame_num, FaceObjectVector& obj_vec)
 {
-	// when sample_frequency is 1, it gives automatic verification
-	if (frame_num % sample_frequency != 0)
+	// when the interval is 1, it gives automatic verification
+	if (needDetection(frame_num) == false)
 	{
 		// keep tracking
 		if (obj_vec.size() > 0)
 		{
 			FaceObject& obj = *obj_vec[0];
 
-			// get landmarks
+			// get landmarks, warm start from the prediction
+			int previous[FaceAlignNumPoints * 2];
 			int landmarks[FaceAlignNumPoints * 2];
-			memcpy(landmarks, obj.landmarks, sizeof(int) * FaceAlignNumPoints * 2);
+			memcpy(previous, obj.landmarks, sizeof(int) * FaceAlignNumPoints * 2);
+			predictLandmarks(obj, landmarks);
 			face_align.pipeline(input, in_height, in_width, in_channel,
 				FaceAlignNumPoints, landmarks, obj.landmarks);
 
-			// check based on IOU
+			// check based on IOU against the last observation, not the prediction
 			float iou, area, flow;
-			if (checkValid(landmarks, obj.landmarks,
-				FaceAlignNumPoints, iou, area, flow) == true)
+			bool valid = checkValid(previous, obj.landmarks, FaceAlignNumPoints, iou, area, flow);
+			observeMotion(previous, obj.landmarks);
+			if (valid == true)
 			{
 				// smooth position in data(box,points)
-				smoothPosition(landmarks, obj);
+				smoothPosition(previous, obj);
 			}
 			else
 			{
@@ -381,9 +527,12 @@ void FaceTracking::updateFastOneFace(const unsigned char* input, int in_height,
 			// remain the first
 			FaceObject& obj = *obj_vec[0];
 
-			// detecting in local
+			// detecting in local, around the predicted position
+			int landmarks[FaceAlignNumPoints * 2];
+			bool predicted = predictLandmarks(obj, landmarks);
 			FaceObjectVector obj_vec_tmp;
-			detectLocal(input, in_height, in_width, in_channel, obj, obj_vec_tmp);
+			detectLocal(input, in_height, in_width, in_channel, landmarks, predicted, obj_vec_tmp);
+			face_scheduler.markDetected(frame_num);
 
 			int size = obj_vec_tmp.size();
 			if (size > 0)
@@ -393,9 +542,9 @@ void FaceTracking::updateFastOneFace(const unsigned char* input, int in_height,
 				{
 					FaceObject* cur = obj_vec_tmp[index];
 					face_align.pipeline(input, in_height, in_width, in_channel,
-						FaceAlignNumPoints, obj.landmarks, cur->landmarks);
+						FaceAlignNumPoints, landmarks, cur->landmarks);
 					smoothPosition(obj, *cur);
-					obj_vec_tmp[index] = NULL;
+					obj_vec_tmp.take(index);
 					FaceDetector::freeVector(obj_vec);
 					FaceDetector::freeVector(obj_vec_tmp);
 					obj_vec.push_back(cur);
@@ -423,18 +572,16 @@ void FaceTracking::updateFastOneFace(const unsigned char* input, int in_height,
 	// sort by area
 	sortObjects(obj_vec);
 
-	// retain only one face
+	// retain only one face, erase releases the others
 	if (obj_vec.size() > 1)
-	{
-		for (int n = 1; n < obj_vec.size(); n++)
-			delete obj_vec[n];
 		obj_vec.erase(++obj_vec.begin(), obj_vec.end());
-	}
 }
 
 void FaceTracking::pipelineUpdate(const unsigned char* input, 
 	int in_height, int in_width, int in_channel, unsigned int frame_num, FaceObjectVector& obj_vec)
 {
+	auto beg = getTimeInUs();
+	frame_index = frame_num;
 	if (frame_num > 0)
 	{
 		if (mode == FaceTrackingMode::Common)
@@ -449,4 +596,11 @@ void FaceTracking::pipelineUpdate(const unsigned char* input,
 		// frame index start from 0
 		updateCommon(input, in_height, in_width, in_channel, frame_num, obj_vec);
 	}
+
+	// drop the motion of lost objects
+	pruneMotions(obj_vec);
+
+	// adapt the detection interval to the motion and the cost of this frame
+	auto end = getTimeInUs();
+	face_scheduler.finishFrame(static_cast<float>(end - beg) / 1000.f);
 }
@@ -2,8 +2,12 @@
 #ifndef __Face_Tracking__
 #define __Face_Tracking__
 
+#include <map>
 #include "face_align.h"
 #include "face_detection.h"
+#include "face_assignment.h"
+#include "face_motion.h"
+#include "face_scheduler.h"
 
 
 class FaceTracking
@@ -26,6 +30,8 @@ protected:
 	// base handle
 	FaceDetector& face_detector;
 	FaceAlign& face_align;
+	FaceAssignment face_assignment;
+	FaceScheduler face_scheduler;
 	// tracking config
 	FaceTrackingMode mode = FaceTrackingMode::FastAllFace;
 	SortingMethod method = SortingMethod::Score;
@@ -33,26 +39,38 @@ protected:
 	bool auto_detect = true;
 	int frequency_enter = 0;
 	int sample_frequency = 4;
+	bool adaptive_schedule = true;
 	float iou_threshold = 0.6f;
 	int face_area_minimum = 32 * 32;
 	float points_flow_maximum = 0.0625;
 	float smooth_momentum = 0.8f;
 	int local_crop_height = 160;
 	int local_crop_width = 160;
+	// motion model
+	bool use_motion = true;
+	float local_expansion = 0.5f;
+	unsigned int frame_index = 0;
+	std::map<int, FaceMotion> motions;
 
 protected:
 	float calculateIOU(const int* previous, const int* current, int num_points);
 	float calculateArea(const int* points, int num_points);
 	float calculateFlow(const int* previous, const int* current, int num_points);
 	bool checkValid(const int* previous, const int* current, int num_points, float& iou, float& area, float& flow);
+	bool needDetection(unsigned int frame_num);
+	void observeMotion(const int* previous, const int* current);
 	void detectLocal(const unsigned char* input, int in_height, int in_width,
-		int in_channel, const FaceObject& obj, FaceObjectVector& obj_vec);
+		int in_channel, const int* landmarks, bool predicted, FaceObjectVector& obj_vec);
 	void smoothPosition(const FaceObject& pre, FaceObject& cur);
 	void smoothPosition(const int* landmarks, FaceObject& cur);
 	int findBestMatch(const FaceObjectVector& obj_vec, FaceObject& cur);
+	void associateObjects(const FaceObjectVector& obj_vec_pre, const FaceObjectVector& obj_vec_cur, std::vector<int>& match);
 	void finetuneFromLandmarks(FaceObject& obj);
 	void smoothBox(const int* previous, int* current);
 	void smoothLandmarks(const int* previous, int* current);
+	bool predictLandmarks(const FaceObject& obj, int* landmarks);
+	bool filterLandmarks(FaceObject& cur);
+	void pruneMotions(const FaceObjectVector& obj_vec);
 	void sortObjects(FaceObjectVector& obj_vec);
 	static bool sortByArea(const FaceObject* x, const FaceObject* y);
 	static bool sortByScore(const FaceObject* x, const FaceObject* y);
@@ -69,6 +87,9 @@ public:
 	void initialize();
 	void setMode(FaceTrackingMode mode);
 	void setFrequencyEnter(int frequency_enter);
+	void setAssignment(FaceAssignment::AssignmentMethod method, float iou_gate);
+	void setMotionModel(bool enable);
+	void setSchedule(bool adaptive, float latency_budget_ms = 0.f, int interval_minimum = 1, int interval_maximum = 32);
 	void pipelineUpdate(const unsigned char* input, int in_height, int in_width, int in_channel, 
 		unsigned int frame_num, FaceObjectVector& obj_vec);
 };
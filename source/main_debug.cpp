@@ -135,6 +135,7 @@ void testCamera_FaceMasking()
 	cv::Mat uv_texture = cv::imread("D:\\Project\\cython-extension\\face_mesh_render\\asset\\texture.png", cv::IMREAD_UNCHANGED);
 
 	// update
+	FaceRenderContext render_context;
 	int fps = 0;
 	float sum = 0, cost = 0, mean = 0;
 	while (capture.read(mat) == true)
@@ -149,7 +150,7 @@ void testCamera_FaceMasking()
 		// masking with texture
 		//face_render.inference(result_vector[0], uv_texture, result_render);
 		// masking without texture
-		face_render.inference(result_vector[0], result_render);
+		face_render.inference(result_vector[0], result_render, render_context);
 		FaceRenderResult result_source;
 		face_render.pasteBack(result_vector[0], result_render, image.cv_mat, result_source);
 		auto end = getTimeInUs();
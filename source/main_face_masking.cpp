@@ -4,8 +4,10 @@
 #include "tools/timer.h"
 #include "tools/strfunc.h"
 #include "tools/visfunc.h"
+#include "tools/flight_recorder.h"
 #include "face_3dmm/face_3dmm.h"
 #include "face_3dmm/face_render.h"
+#include "face_3dmm/face_fitting.h"
 
 
 void main_FaceMasking()
@@ -14,6 +16,17 @@ void main_FaceMasking()
 	face_3dmm.initialize("face_reconstruction.ncnn.param", "face_reconstruction.ncnn.bin");
 	FaceRender face_render;
 	face_render.initialize("face_masking.bin");
+	// frames slower than 50ms are dumped with the last 32 frames for replay
+	FlightRecorder flight_recorder;
+	flight_recorder.setConfig(".", 50.f);
+	face_3dmm.setRecorder(&flight_recorder);
+	// temporal mode: tracked faces, the network only runs on key frames
+	face_3dmm.setTrackingMode(FaceTracking::FaceTrackingMode::FastAllFace);
+	face_3dmm.setTemporalConfig(8, 0.05f, 3, 0.6f);
+	// between two regressions pose and expression follow the tracked landmarks
+	FaceFitting face_fitting;
+	face_fitting.initialize(face_render);
+	face_3dmm.setFitting(&face_fitting);
 
 	cv::VideoCapture capture(0);
 	assert(capture.isOpened());
@@ -22,13 +35,17 @@ void main_FaceMasking()
 	cout << formatString("open camera: (%d, %d)", h, w) << endl;
 
 	cv::Mat mat;
-	FaceObjectVector info_vector;
 	unsigned int counter = 0;
-	cv::Mat uv_texture = cv::imread("texture.png", cv::IMREAD_UNCHANGED);
+	// textures are decoded and preprocessed once, faces reference them by handle
+	FaceTextureRegistry& texture_registry = FaceTextureRegistry::getInstance();
+	FaceTextureHandle texture_handle = texture_registry.load("texture.png");
+	FaceRenderContext render_context;
+	FaceRenderResult result_render;
 
 	// update
 	bool flag_is_texture = 0;
 	bool flag_flip = false;
+	bool flag_temporal = false;
 	int fps = 0;
 	float sum = 0, cost = 0, mean = 0;
 	while (capture.read(mat) == true)
@@ -37,31 +54,40 @@ void main_FaceMasking()
 		XImage image(mat);
 		// modeling
 		auto beg = getTimeInUs();
+		flight_recorder.beginFrame(counter, image.data, image.height, image.width, image.channel);
 		Face3DMMResultVector result_vector;
-		face_3dmm.inference(image, result_vector);
-		FaceRenderResult result_render;
-		if (flag_is_texture)
-			face_render.inference(result_vector[0], uv_texture, result_render);
-		else face_render.inference(result_vector[0], result_render);
-		FaceRenderResult result_source;
-		face_render.pasteBack(result_vector[0], result_render, image.cv_mat, result_source);
+		if (flag_temporal == true)
+			face_3dmm.inferenceTemporal(image, counter, result_vector);
+		else face_3dmm.inference(image, result_vector);
+		FlightRecorder::Stage stage_render(&flight_recorder, "render");
+		std::shared_ptr<const FaceTexture> texture = flag_is_texture ? texture_registry.acquire(texture_handle) : nullptr;
+		if (texture != nullptr)
+			face_render.inference(result_vector[0], *texture, result_render, render_context);
+		else face_render.inference(result_vector[0], result_render, render_context);
+		stage_render.end();
+		// the paste draws over the camera frame, keep the input for a possible dump
+		flight_recorder.snapshotInput();
+		FlightRecorder::Stage stage_paste(&flight_recorder, "paste");
+		face_render.pasteBackInplace(result_vector[0], result_render, mat);
+		stage_paste.end();
+		flight_recorder.endFrame();
 		auto end = getTimeInUs();
 		// time & fps
 		sum += cost = (end - beg) / 1000.f;
 		mean = sum / ++counter;
 		fps = 1000.f / mean;
 		// visual
-		visText(result_source.image, formatString("mean: %2dms", static_cast<int>(mean + 0.5)), w * 0.8, h * 0.05);
-		visText(result_source.image, formatString("delay: %2dms", static_cast<int>(cost + 0.5)), w * 0.8, h * 0.1);
-		visText(result_source.image, formatString("fps: %2d", static_cast<int>(fps)), w * 0.8, h * 0.15);
-		cv::imshow("show", result_source.image);
+		visText(mat, formatString("mean: %2dms", static_cast<int>(mean + 0.5)), w * 0.8, h * 0.05);
+		visText(mat, formatString("delay: %2dms", static_cast<int>(cost + 0.5)), w * 0.8, h * 0.1);
+		visText(mat, formatString("fps: %2d", static_cast<int>(fps)), w * 0.8, h * 0.15);
+		cv::imshow("show", mat);
 		int key = cv::waitKey(1);
 		if (key == 'q') break;
 		if (key == 'f') flag_flip = !flag_flip;
 		if (key == ' ') flag_is_texture = !flag_is_texture;
+		if (key == 't') flag_temporal = !flag_temporal;
 	}
 
-	FaceDetector::freeVector(info_vector);
 	capture.release();
 }
 
@@ -5,6 +5,11 @@
 #include <algorithm>
 #include <omp.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CVFUNC_USE_SSE2
+#endif
+
 #ifndef StdMax
 #define StdMax(a,b)  (((a) > (b)) ? (a) : (b))
 #endif
@@ -210,8 +215,8 @@ void splitImage(const cv::Mat& source, cv::Mat& image, cv::Mat& alpha)
         #pragma omp parallel for num_threads(4)
         for (int i = 0; i < rows; ++i) {
             for (int j = 0; j < cols; ++j) {
-                auto& data_src = source.at<cv::Vec4b>(i, j);
-                auto& data_img = image.at<cv::Vec3b>(i, j);
+                auto& data_src = source.at<cv::Vec4f>(i, j);
+                auto& data_img = image.at<cv::Vec3f>(i, j);
                 data_img[0] = static_cast<float>(data_src[0]);
                 data_img[1] = static_cast<float>(data_src[1]);
                 data_img[2] = static_cast<float>(data_src[2]);
@@ -224,6 +229,134 @@ void splitImage(const cv::Mat& source, cv::Mat& image, cv::Mat& alpha)
     }    
 }
 
+cv::Rect calculateMaskBoundingBox(const cv::Mat& mask)
+{
+    if (mask.empty() || mask.channels() != 1) {
+        throw std::invalid_argument("Mask must be a non-empty 1-channel matrix");
+    }
+    if (mask.depth() != CV_8U && mask.depth() != CV_32F) {
+        throw std::invalid_argument("Mask must be a 8UC1 or 32FC1 matrix");
+    }
+
+    int x_min = mask.cols, x_max = -1;
+    int y_min = mask.rows, y_max = -1;
+    const bool is_uint = mask.depth() == CV_8U;
+    for (int i = 0; i < mask.rows; ++i) {
+        int lft = -1, rig = -1;
+        if (is_uint) {
+            const uchar* row = mask.ptr<uchar>(i);
+            for (int j = 0; j < mask.cols; ++j) if (row[j] != 0) { lft = j; break; }
+            if (lft < 0) continue;
+            for (int j = mask.cols - 1; j >= lft; --j) if (row[j] != 0) { rig = j; break; }
+        }
+        else {
+            const float* row = mask.ptr<float>(i);
+            for (int j = 0; j < mask.cols; ++j) if (row[j] > 0.f) { lft = j; break; }
+            if (lft < 0) continue;
+            for (int j = mask.cols - 1; j >= lft; --j) if (row[j] > 0.f) { rig = j; break; }
+        }
+        x_min = StdMin(x_min, lft);
+        x_max = StdMax(x_max, rig);
+        y_min = StdMin(y_min, i);
+        y_max = i;
+    }
+
+    if (x_max < 0) {
+        return cv::Rect();
+    }
+    return cv::Rect(x_min, y_min, x_max - x_min + 1, y_max - y_min + 1);
+}
+
+// 单行融合: 定点运算 (f * a + b * (255 - a) + 128) / 255, 结果与四舍五入一致
+static void blendRowU8C3(const uchar* fg, const uchar* alpha, uchar* dst, int width, uchar* alpha3)
+{
+    // alpha扩展为与BGR一一对应, 之后按连续字节处理
+    for (int j = 0; j < width; ++j) {
+        alpha3[j * 3 + 0] = alpha3[j * 3 + 1] = alpha3[j * 3 + 2] = alpha[j];
+    }
+
+    const int n = width * 3;
+    int i = 0;
+#ifdef CVFUNC_USE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i v255 = _mm_set1_epi16(255);
+    const __m128i v128 = _mm_set1_epi16(128);
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(alpha3 + i));
+        __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fg + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i a_lo = _mm_unpacklo_epi8(a, zero);
+        __m128i a_hi = _mm_unpackhi_epi8(a, zero);
+        __m128i x_lo = _mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpacklo_epi8(f, zero), a_lo),
+            _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), _mm_sub_epi16(v255, a_lo)));
+        __m128i x_hi = _mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpackhi_epi8(f, zero), a_hi),
+            _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), _mm_sub_epi16(v255, a_hi)));
+        x_lo = _mm_add_epi16(x_lo, v128);
+        x_hi = _mm_add_epi16(x_hi, v128);
+        x_lo = _mm_srli_epi16(_mm_add_epi16(x_lo, _mm_srli_epi16(x_lo, 8)), 8);
+        x_hi = _mm_srli_epi16(_mm_add_epi16(x_hi, _mm_srli_epi16(x_hi, 8)), 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(x_lo, x_hi));
+    }
+#endif
+    for (; i < n; ++i) {
+        int x = fg[i] * alpha3[i] + dst[i] * (255 - alpha3[i]) + 128;
+        dst[i] = static_cast<uchar>((x + (x >> 8)) >> 8);
+    }
+}
+
+static void blendRowF32C3(const float* fg, const float* alpha, float* dst, int width)
+{
+    const float scale = 1.f / 255.f;
+    for (int j = 0; j < width; ++j) {
+        const float a = alpha[j] * scale;
+        dst[j * 3 + 0] += (fg[j * 3 + 0] - dst[j * 3 + 0]) * a;
+        dst[j * 3 + 1] += (fg[j * 3 + 1] - dst[j * 3 + 1]) * a;
+        dst[j * 3 + 2] += (fg[j * 3 + 2] - dst[j * 3 + 2]) * a;
+    }
+}
+
+void blendImageInplace(const cv::Mat& foreground, const cv::Mat& mask, cv::Mat& canvas)
+{
+    // 1. 检查输入
+    if (foreground.empty() || mask.empty() || canvas.empty()) {
+        throw std::invalid_argument("Input matrices cannot be empty");
+    }
+    if (mask.size() != canvas.size() || mask.size() != foreground.size()) {
+        throw std::invalid_argument("All input matrices must have the same size");
+    }
+    bool is_uint = bool(foreground.type() == CV_8UC3 && canvas.type() == CV_8UC3 && mask.type() == CV_8UC1);
+    bool is_float = bool(foreground.type() == CV_32FC3 && canvas.type() == CV_32FC3 && mask.type() == CV_32FC1);
+    if (is_uint == false && is_float == false) {
+        throw std::invalid_argument("All inputs must be uint or float");
+    }
+
+    // 2. 只处理mask的包围盒, alpha为0的区域保持不变
+    const cv::Rect box = calculateMaskBoundingBox(mask);
+    if (box.area() == 0) {
+        return;
+    }
+
+    // 3. 逐行融合(按行指针访问, 兼容ROI视图)
+    const int width = box.width;
+    #pragma omp parallel if (box.area() > 128 * 128)
+    {
+        std::vector<uchar> alpha3(is_uint ? width * 3 : 0);
+        #pragma omp for schedule(static)
+        for (int i = box.y; i < box.y + box.height; ++i) {
+            if (is_uint) {
+                blendRowU8C3(foreground.ptr<uchar>(i) + box.x * 3, mask.ptr<uchar>(i) + box.x,
+                    canvas.ptr<uchar>(i) + box.x * 3, width, alpha3.data());
+            }
+            else {
+                blendRowF32C3(foreground.ptr<float>(i) + box.x * 3, mask.ptr<float>(i) + box.x,
+                    canvas.ptr<float>(i) + box.x * 3, width);
+            }
+        }
+    }
+}
+
 void fuseImage(const cv::Mat& foreground, const cv::Mat& background, const cv::Mat& mask_f, cv::Mat& fusion)
 {
     // 1. 检查输入是否为空
@@ -253,38 +386,11 @@ void fuseImage(const cv::Mat& foreground, const cv::Mat& background, const cv::M
         throw std::runtime_error("Inputs must be continuous matrices");
     }
 
-    // 6. 手动循环处理每个像素
-    int rows = foreground.rows;
-    int cols = foreground.cols;
-    size_t total_pixels = rows * cols;
-    if (is_uint == true) {
-        fusion.create(foreground.size(), CV_8UC3);
-        #pragma omp parallel for num_threads(4)
-        for (int i = 0; i < foreground.rows; ++i) {
-            for (int j = 0; j < foreground.cols; ++j) {
-                float alpha = static_cast<float>(mask_f.at<uchar>(i, j)) / 255.f;
-                float inv_alpha = 1.0f - alpha;
-                for (int c = 0; c < 3; ++c) {
-                    float fg_val = static_cast<float>(foreground.at<cv::Vec3b>(i, j)[c]);
-                    float bg_val = static_cast<float>(background.at<cv::Vec3b>(i, j)[c]);
-                    fusion.at<cv::Vec3b>(i, j)[c] = static_cast<uchar>(fg_val * alpha + bg_val * inv_alpha);
-                }
-            }
-        }
-    } 
-    else {
-        fusion.create(foreground.size(), CV_32FC3);
-        #pragma omp parallel for num_threads(4)
-        for (int i = 0; i < foreground.rows; ++i) {
-            for (int j = 0; j < foreground.cols; ++j) {
-                float alpha = static_cast<float>(mask_f.at<float>(i, j)) / 255.f;
-                float inv_alpha = 1.0f - alpha;
-                for (int c = 0; c < 3; ++c) {
-                    float fg_val = static_cast<float>(foreground.at<cv::Vec3b>(i, j)[c]);
-                    float bg_val = static_cast<float>(background.at<cv::Vec3b>(i, j)[c]);
-                    fusion.at<cv::Vec3b>(i, j)[c] = static_cast<float>(fg_val * alpha + bg_val * inv_alpha);
-                }
-            }
-        }
+    // 6. 在背景的拷贝上原地融合, fusion与前景共用内存时先保留前景, 否则拷贝背景会覆盖它
+    cv::Mat source = foreground;
+    if (!fusion.empty() && fusion.datastart < foreground.dataend && foreground.datastart < fusion.dataend) {
+        source = foreground.clone();
     }
-}
\ No newline at end of file
+    background.copyTo(fusion);
+    blendImageInplace(source, mask_f, fusion);
+}
@@ -19,4 +19,9 @@ inline bool formatAsMatrix(const int* data, unsigned int rows, unsigned int cols
 void splitImage(const cv::Mat& source, cv::Mat& image, cv::Mat& alpha);
 void fuseImage(const cv::Mat& foreground, const cv::Mat& background, const cv::Mat& mask_f, cv::Mat& fusion);
 
+// alpha融合(原地): canvas = foreground * alpha + canvas * (1 - alpha), 只处理mask的非零包围盒
+// 支持 8UC3/8UC1 (定点+SIMD) 与 32FC3/32FC1 (mask取值0~255), canvas可以是大图的ROI视图
+cv::Rect calculateMaskBoundingBox(const cv::Mat& mask);
+void blendImageInplace(const cv::Mat& foreground, const cv::Mat& mask, cv::Mat& canvas);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,270 @@
+#include <cstring>
+#include "flight_recorder.h"
+#include "timer.h"
+#include "strfunc.h"
+#include "xarray.h"
+
+
+FlightRecorder::Stage::Stage(FlightRecorder* recorder, const char* name)
+{
+	this->recorder = recorder;
+	this->index = recorder != nullptr ? recorder->beginStage(name) : -1;
+}
+
+FlightRecorder::Stage::~Stage()
+{
+	end();
+}
+
+void FlightRecorder::Stage::end()
+{
+	if (recorder != nullptr && index >= 0)
+		recorder->endStage(index);
+	index = -1;
+}
+
+
+FlightRecorder::FlightRecorder()
+{
+	ring.resize(32);
+}
+
+FlightRecorder::~FlightRecorder()
+{
+
+}
+
+void FlightRecorder::setConfig(const std::string& directory, float threshold, int capacity, int max_dumps)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	this->directory = directory;
+	this->threshold = threshold;
+	this->max_dumps = max_dumps;
+	ring.clear();
+	ring.resize(StdMax(capacity, 1));
+	head = 0;
+	count = 0;
+	recording = false;
+}
+
+void FlightRecorder::setHashStride(int rows)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	hash_stride = StdMax(rows, 1);
+}
+
+int FlightRecorder::getNumDumps() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return num_dumps;
+}
+
+uint64_t FlightRecorder::hashImage(const unsigned char* data, int height, int width, int channel) const
+{
+	// FNV-1a over 8-byte words of every hash_stride-th row, rows are contiguous
+	const size_t row_size = static_cast<size_t>(width) * channel;
+	uint64_t hash = 14695981039346656037ull;
+	for (int y = 0; y < height; y += hash_stride)
+	{
+		const unsigned char* row = data + y * row_size;
+		size_t k = 0;
+		for (; k + 8 <= row_size; k += 8)
+		{
+			uint64_t word;
+			std::memcpy(&word, row + k, 8);
+			hash = (hash ^ word) * 1099511628211ull;
+		}
+		for (; k < row_size; k++)
+			hash = (hash ^ row[k]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+void FlightRecorder::beginFrame(unsigned int frame_num, const unsigned char* data, int height, int width, int channel)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	FrameRecord& record = ring[head];
+	record.frame_num = frame_num;
+	record.begin = getTimeInUs();
+	record.end = record.begin;
+	record.num_stages = 0;
+	record.num_faces = 0;
+	record.hash = hashImage(data, height, width, channel);
+
+	// the input is only needed when the frame turns out slow, so it is not copied here
+	image_data = data;
+	image_h = height;
+	image_w = width;
+	image_c = channel;
+	coefficients_identity.clear();
+	coefficients.clear();
+	recording = true;
+}
+
+void FlightRecorder::snapshotInput()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (recording == false || image_data == nullptr || image_data == image_copy.data())
+		return;
+	// the copy reuses its buffer across frames
+	image_copy.resize(static_cast<size_t>(image_h) * image_w * image_c);
+	std::memcpy(image_copy.data(), image_data, image_copy.size());
+	image_data = image_copy.data();
+}
+
+int FlightRecorder::beginStage(const char* name)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	FrameRecord& record = ring[head];
+	if (recording == false || record.num_stages == MaxStages)
+		return -1;
+	const int index = record.num_stages++;
+	record.stage_names[index] = name;
+	record.stage_times[index][0] = getTimeInUs();
+	record.stage_times[index][1] = record.stage_times[index][0];
+	return index;
+}
+
+void FlightRecorder::endStage(int index)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	FrameRecord& record = ring[head];
+	if (recording == false || index < 0 || index >= record.num_stages)
+		return;
+	record.stage_times[index][1] = getTimeInUs();
+}
+
+void FlightRecorder::recordObjects(const FaceObjectVector& objects)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	FrameRecord& record = ring[head];
+	if (recording == false)
+		return;
+	record.num_faces = 0;
+	for (const FaceObject* object : objects)
+	{
+		if (object == NULL || record.num_faces == MaxFaces)
+			continue;
+		FaceRecord& face = record.faces[record.num_faces++];
+		face.identity = object->identity;
+		face.score = object->score;
+		std::memcpy(face.box, object->box, sizeof(face.box));
+		std::memcpy(face.landmarks, object->landmarks, sizeof(face.landmarks));
+	}
+}
+
+void FlightRecorder::recordCoefficients(int identity, const float* parameters)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (recording == false)
+		return;
+	coefficients_identity.push_back(identity);
+	coefficients.insert(coefficients.end(), parameters, parameters + NumCoefficients);
+}
+
+bool FlightRecorder::endFrame()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (recording == false)
+		return false;
+	recording = false;
+	FrameRecord& record = ring[head];
+	record.end = getTimeInUs();
+	const int capacity = static_cast<int>(ring.size());
+	head = (head + 1) % capacity;
+	count = StdMin(count + 1, capacity);
+
+	const float latency = (record.end - record.begin) / 1000.f;
+	if (latency <= threshold || num_dumps >= max_dumps)
+		return false;
+	// failed saves do not use up the cap
+	if (dump(record).empty() == true)
+		return false;
+	num_dumps++;
+	return true;
+}
+
+std::string FlightRecorder::dump(const FrameRecord& record)
+{
+	const int capacity = static_cast<int>(ring.size());
+	const int first = (head + capacity - count) % capacity;
+	std::vector<unsigned int> frames(count);
+	std::vector<unsigned int> hashes(count * 2);
+	std::vector<float> latencies(count);
+	std::vector<int> stage_index(count * MaxStages, -1);
+	std::vector<float> stage_time(count * MaxStages * 2, -1.f);
+	std::vector<int> num_faces(count);
+	std::vector<int> face_identity;
+	std::vector<float> face_score;
+	std::vector<int> face_box;
+	std::vector<int> face_landmarks;
+	std::vector<const char*> names;
+	for (int n = 0; n < count; n++)
+	{
+		const FrameRecord& frame = ring[(first + n) % capacity];
+		frames[n] = frame.frame_num;
+		hashes[n * 2 + 0] = static_cast<unsigned int>(frame.hash);
+		hashes[n * 2 + 1] = static_cast<unsigned int>(frame.hash >> 32);
+		latencies[n] = (frame.end - frame.begin) / 1000.f;
+		for (int s = 0; s < frame.num_stages; s++)
+		{
+			int index = 0;
+			while (index < static_cast<int>(names.size()) && std::strcmp(names[index], frame.stage_names[s]) != 0)
+				index++;
+			if (index == static_cast<int>(names.size()))
+				names.push_back(frame.stage_names[s]);
+			stage_index[n * MaxStages + s] = index;
+			stage_time[(n * MaxStages + s) * 2 + 0] = (frame.stage_times[s][0] - frame.begin) / 1000.f;
+			stage_time[(n * MaxStages + s) * 2 + 1] = (frame.stage_times[s][1] - frame.begin) / 1000.f;
+		}
+		num_faces[n] = frame.num_faces;
+		for (int k = 0; k < frame.num_faces; k++)
+		{
+			const FaceRecord& face = frame.faces[k];
+			face_identity.push_back(face.identity);
+			face_score.push_back(face.score);
+			face_box.insert(face_box.end(), face.box, face.box + 4);
+			face_landmarks.insert(face_landmarks.end(), face.landmarks, face.landmarks + FaceAlignNumPoints * 2);
+		}
+	}
+	std::string name_table;
+	for (const char* name : names)
+		name_table += std::string(name) + "\n";
+
+	// XArray has no copy, the arrays are built in place; zero dimensions are not allowed
+	XArrayContainer container;
+	auto put = [&container](const char* key, const std::vector<unsigned int>& shape, DataTypeCode code, const void* data)
+	{
+		for (unsigned int dim : shape)
+			if (dim == 0)
+				return;
+		container.array_map[key].initialize(shape, code, const_cast<void*>(data), true);
+	};
+	const unsigned int n = static_cast<unsigned int>(count);
+	const unsigned int m = static_cast<unsigned int>(face_identity.size());
+	const unsigned int j = static_cast<unsigned int>(coefficients_identity.size());
+	const unsigned int stages = MaxStages;
+	if (image_data != nullptr)
+		put("image", { static_cast<unsigned int>(image_h), static_cast<unsigned int>(image_w),
+			static_cast<unsigned int>(image_c) }, DataTypeCode::UINT8, image_data);
+	put("frame", { n }, DataTypeCode::UINT32, frames.data());
+	put("hash", { n, 2 }, DataTypeCode::UINT32, hashes.data());
+	put("latency", { n }, DataTypeCode::FLOAT32, latencies.data());
+	put("stage_name", { static_cast<unsigned int>(name_table.size()) }, DataTypeCode::UINT8, name_table.data());
+	put("stage_index", { n, stages }, DataTypeCode::INT32, stage_index.data());
+	put("stage_time", { n, stages, 2 }, DataTypeCode::FLOAT32, stage_time.data());
+	put("num_faces", { n }, DataTypeCode::INT32, num_faces.data());
+	put("face_identity", { m }, DataTypeCode::INT32, face_identity.data());
+	put("face_score", { m }, DataTypeCode::FLOAT32, face_score.data());
+	put("face_box", { m, 4 }, DataTypeCode::INT32, face_box.data());
+	put("face_landmarks", { m, FaceAlignNumPoints * 2 }, DataTypeCode::INT32, face_landmarks.data());
+	put("coefficients", { j, NumCoefficients }, DataTypeCode::FLOAT32, coefficients.data());
+	put("coefficients_identity", { j }, DataTypeCode::INT32, coefficients_identity.data());
+
+	const float latency = (record.end - record.begin) / 1000.f;
+	std::string path = formatString("%s/flight_%06u_%dms.bin", directory.c_str(), record.frame_num,
+		static_cast<int>(latency + 0.5f));
+	if (container.save(path) == false)
+		return std::string();
+	return path;
+}
@@ -0,0 +1,110 @@
+
+#ifndef __Flight_Recorder__
+#define __Flight_Recorder__
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "face_base/face_info.h"
+
+
+// Always-on record of the last frames of a pipeline: a sampled hash of every input, the
+// timeline of its stages and the tracked faces are kept in a ring. A frame slower than the
+// threshold is dumped with the ring to one XArrayContainer file for offline replay:
+//   image            uint8   h,w,c   input of the slow frame
+//   frame            uint32  n       frame numbers of the ring, oldest first
+//   hash             uint32  n,2     sampled input hash (low, high)
+//   latency          float32 n       ms
+//   stage_name       uint8   k       stage names separated by '\n'
+//   stage_index      int32   n,16    index into stage_name, -1 when unused
+//   stage_time       float32 n,16,2  begin/end in ms since the frame began
+//   num_faces        int32   n       faces per frame, the rows of face_* in ring order
+//   face_identity    int32   m
+//   face_score       float32 m
+//   face_box         int32   m,4
+//   face_landmarks   int32   m,136
+//   coefficients     float32 j,257   3dmm coefficients of the slow frame
+//   coefficients_identity int32 j
+// Empty arrays are left out. The pipeline calls happen on one thread, dumps are serialized.
+class FlightRecorder
+{
+public:
+	FlightRecorder();
+	~FlightRecorder();
+
+public:
+	static const int MaxStages = 16;
+	static const int MaxFaces = 8;
+	static const int NumCoefficients = 257;
+
+	// scoped stage, a null recorder records nothing
+	class Stage
+	{
+	public:
+		Stage(FlightRecorder* recorder, const char* name);
+		~Stage();
+		void end();
+	protected:
+		FlightRecorder* recorder;
+		int index;
+	};
+
+protected:
+	struct FaceRecord
+	{
+		int identity;
+		float score;
+		int box[4];
+		int landmarks[FaceAlignNumPoints * 2];
+	};
+	struct FrameRecord
+	{
+		unsigned int frame_num = 0;
+		uint64_t hash = 0;
+		uint64_t begin = 0, end = 0;
+		int num_stages = 0;
+		const char* stage_names[MaxStages];   // string literals
+		uint64_t stage_times[MaxStages][2];
+		int num_faces = 0;
+		FaceRecord faces[MaxFaces];
+	};
+	mutable std::mutex mutex;
+	std::string directory = ".";
+	float threshold = 50.f;   // ms
+	int max_dumps = 16;
+	int hash_stride = 8;      // rows
+	// ring, head is the frame in flight
+	std::vector<FrameRecord> ring;
+	int head = 0;
+	int count = 0;
+	bool recording = false;
+	int num_dumps = 0;
+	// input and coefficients of the frame in flight
+	const unsigned char* image_data = nullptr;
+	int image_h = 0, image_w = 0, image_c = 0;
+	std::vector<unsigned char> image_copy;
+	std::vector<int> coefficients_identity;
+	std::vector<float> coefficients;
+
+public:
+	// the directory has to exist
+	void setConfig(const std::string& directory, float threshold, int capacity = 32, int max_dumps = 16);
+	void setHashStride(int rows);
+	int getNumDumps() const;
+	// the image is referenced, not copied: it must stay unchanged until endFrame, or be
+	// saved with snapshotInput before the pipeline modifies it in place
+	void beginFrame(unsigned int frame_num, const unsigned char* data, int height, int width, int channel);
+	void snapshotInput();
+	int beginStage(const char* name);
+	void endStage(int index);
+	void recordObjects(const FaceObjectVector& objects);
+	void recordCoefficients(int identity, const float* parameters);
+	// returns true when the frame has been dumped
+	bool endFrame();
+protected:
+	uint64_t hashImage(const unsigned char* data, int height, int width, int channel) const;
+	std::string dump(const FrameRecord& record);
+};
+
+#endif
@@ -437,26 +437,29 @@ bool XArrayContainer::save(const std::string& path) const
         return false;
     }
 
-    size_t num_arrays = array_map.size();
-    file.write(reinterpret_cast<const char*>(&num_arrays), sizeof(size_t));
+    // the layout read by load
+    uint32_t version = 1;
+    file.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    uint32_t num_arrays = static_cast<uint32_t>(array_map.size());
+    file.write(reinterpret_cast<const char*>(&num_arrays), sizeof(uint32_t));
 
     for (const auto& pair : array_map) {
         // д key Ⱥַ
-        size_t key_len = pair.first.length();
-        file.write(reinterpret_cast<const char*>(&key_len), sizeof(size_t));
+        uint32_t key_len = static_cast<uint32_t>(pair.first.length());
+        file.write(reinterpret_cast<const char*>(&key_len), sizeof(uint32_t));
         file.write(pair.first.c_str(), key_len);
 
+        // д type
+        uint32_t type_code = static_cast<uint32_t>(pair.second.type_info.type);
+        file.write(reinterpret_cast<const char*>(&type_code), sizeof(uint32_t));
+
         // д shape
-        size_t dim = pair.second.shape.size();
-        file.write(reinterpret_cast<const char*>(&dim), sizeof(size_t));
-        for (size_t i = 0; i < dim; ++i) {
+        uint32_t dim = static_cast<uint32_t>(pair.second.shape.size());
+        file.write(reinterpret_cast<const char*>(&dim), sizeof(uint32_t));
+        for (uint32_t i = 0; i < dim; ++i) {
             file.write(reinterpret_cast<const char*>(&pair.second.shape[i]), sizeof(unsigned int));
         }
 
-        // д type
-        int type_code = static_cast<int>(pair.second.type_info.type);
-        file.write(reinterpret_cast<const char*>(&type_code), sizeof(int));
-
         // д
         file.write(reinterpret_cast<const char*>(pair.second.data), pair.second.num_bytes);
     }